@@ -0,0 +1,359 @@
+/* JACK MIDI Commander - offline benchmark
+ *
+ * Drives the parser, the event queues and the process callback
+ * against the mock port buffers of jack_mock.c, no jackd required.
+ * Run with `make bench`.
+ *
+ * Copyright (C) 2015 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma GCC diagnostic ignored "-Wunused-function" // only used by main()
+
+#define NO_MAIN
+#include "../jack_midi_cmd.c"
+
+#include "jack_mock.h"
+
+static double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* discard queued events, the bench is the only thread */
+static void queue_reset(void) {
+	uint32_t i;
+	for (i = 0; i < n_outs; ++i) {
+		outs[i].queue[0].tail = outs[i].queue[0].head;
+		outs[i].sched.len = 0;
+	}
+	memset(&stats, 0, sizeof(stats));
+	memset(&latency, 0, sizeof(latency));
+}
+
+/* run cycles until everything queued was sent */
+static void drain(void) {
+	uint32_t i;
+	for (i = 0; i < 1000 && !(all_sent() && outs[0].sched.len == 0); ++i) {
+		mock_cycle();
+	}
+}
+
+/* the parser of version 0.1, for comparison */
+static int parse_sscanf(const char *msg) {
+	jack_midi_data_t buffer[3];
+	my_midi_event_t event = { 0, 0, 0, 3, buffer };
+	unsigned int param[3];
+	if (3 == sscanf(msg, ". %x %x %x\n", &param[0], &param[1], &param[2])) {
+		buffer[0] = param[0] & 0xff;
+		buffer[1] = param[1] & 0x7f;
+		buffer[2] = param[2] & 0x7f;
+	} else if (2 == sscanf(msg, "CC %i %i\n", &param[0], &param[1])) {
+		buffer[0] = 0xb0;
+		buffer[1] = param[0] & 0x7f;
+		buffer[2] = param[1] & 0x7f;
+	} else if (2 == sscanf(msg, "N %i %i\n", &param[0], &param[1])) {
+		buffer[0] = 0x90;
+		buffer[1] = param[0] & 0x7f;
+		buffer[2] = param[1] & 0x7f;
+	} else {
+		return -1;
+	}
+	return queue_event(&event);
+}
+
+static void bench_parser(void) {
+	static const char *const basic[] = { "N 60 100", "CC 7 100", ". 90 3c 7f" };
+	static const char *const mixed[] = {
+		"N 60 100", "+10 CC 7 100", "@123456 . 90 3c 7f", "n 60 0",
+		"F0 7E 7F 06 01 F7", "2 0xc0 5", "# comment",
+	};
+	const uint32_t n = 2000000;
+	double t;
+	uint32_t i;
+
+	printf("parser, lines/s\n");
+
+	queue_reset();
+	t = now_sec();
+	for (i = 0; i < n; ++i) {
+		parse_sscanf(basic[i % 3]);
+		if ((i & 1023) == 1023) {
+			queue_reset();
+		}
+	}
+	printf("  %-24s %12.0f\n", "sscanf (0.1), basic", n / (now_sec() - t));
+
+	queue_reset();
+	t = now_sec();
+	for (i = 0; i < n; ++i) {
+		parse_message(basic[i % 3]);
+		if ((i & 1023) == 1023) {
+			queue_reset();
+		}
+	}
+	printf("  %-24s %12.0f\n", "lexer, basic", n / (now_sec() - t));
+
+	queue_reset();
+	t = now_sec();
+	for (i = 0; i < n; ++i) {
+		parse_message(mixed[i % (sizeof(mixed) / sizeof(mixed[0]))]);
+		if ((i & 1023) == 1023) {
+			queue_reset();
+		}
+	}
+	printf("  %-24s %12.0f\n", "lexer, mixed", n / (now_sec() - t));
+}
+
+static void bench_queue(void) {
+	const uint32_t batch = 1024;
+	const uint32_t rounds = 4000;
+	jack_midi_data_t msg[3] = { 0x90, 60, 100 };
+	my_midi_event_t event = { 0, 0, 0, 3, msg };
+	double t_enq = 0, t_deq = 0, t_send = 0;
+	uint32_t r, i;
+
+	queue_reset();
+	for (r = 0; r < rounds; ++r) {
+		void *out = jack_port_get_buffer(outs[0].port, mock_period);
+		double t = now_sec();
+		for (i = 0; i < batch; ++i) {
+			queue_event(&event);
+		}
+		t_enq += now_sec() - t;
+
+		t = now_sec();
+		queue_drain(&outs[0], mock_cycle_start);
+		t_deq += now_sec() - t;
+
+		/* port_send() pops all, the 64 KiB mock buffer of main()
+		 * holds 65536 / 12 = 5461 short events */
+		t = now_sec();
+		port_send(&outs[0], mock_cycle_start, mock_period, 0);
+		t_send += now_sec() - t;
+
+		jack_midi_clear_buffer(out);
+		mock_cycle_start += mock_period;
+	}
+	printf("queue, ns/op\n");
+	printf("  %-24s %12.1f\n", "enqueue", t_enq * 1e9 / (batch * rounds));
+	printf("  %-24s %12.1f\n", "dequeue to scheduler", t_deq * 1e9 / (batch * rounds));
+	printf("  %-24s %12.1f\n", "schedule and write", t_send * 1e9 / (batch * rounds));
+}
+
+/* events that fit into a single cycle with the given port buffer size */
+static uint32_t events_per_cycle(size_t buffer_size, const jack_midi_data_t *msg, uint32_t size) {
+	const size_t saved = mock_buffer_size;
+	my_midi_event_t event = { 0, 0, 0, size, msg };
+	uint32_t i, n;
+
+	queue_reset();
+	for (i = 0; i < 8192; ++i) {
+		queue_event(&event);
+	}
+	mock_buffer_size = buffer_size;
+	mock_cycle();
+	n = mock_port_events(0);
+	drain();
+	mock_buffer_size = saved;
+	return n;
+}
+
+static void bench_buffer(void) {
+	static const size_t sizes[] = { 4096, 8192, 32768, 65536 };
+	static const jack_midi_data_t note[3] = { 0x90, 60, 100 };
+	static const jack_midi_data_t clock[1] = { 0xf8 };
+	static const jack_midi_data_t sysex[16] = { 0xf0, 0x7e, 0x7f, 0x06, 0x01, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xf7 };
+	uint32_t i;
+
+	printf("events per cycle, by port buffer size\n");
+	printf("  %-24s %12s %12s %12s\n", "bytes", "3 byte", "1 byte", "16 bytes");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		printf("  %-24zu %12u %12u %12u\n", sizes[i],
+				events_per_cycle(sizes[i], note, sizeof(note)),
+				events_per_cycle(sizes[i], clock, sizeof(clock)),
+				events_per_cycle(sizes[i], sysex, sizeof(sysex)));
+	}
+}
+
+/* latency of events queued at random times during the previous cycle */
+static void bench_latency(void) {
+	static const jack_nframes_t periods[] = { 64, 128, 256, 512, 1024, 2048 };
+	const jack_nframes_t saved = mock_period;
+	jack_midi_data_t msg[3] = { 0x90, 60, 100 };
+	uint32_t i, c, k;
+
+	printf("latency, us at %u Hz: immediate (p50 p99 max), scheduled +0 (max)\n", mock_rate);
+	srand(1);
+	for (i = 0; i < sizeof(periods) / sizeof(periods[0]); ++i) {
+		const double us = 1e6 / mock_rate;
+		lat_snapshot_t ls;
+		uint32_t sched_max;
+
+		mock_period = periods[i];
+		for (k = 0; k < 2; ++k) {
+			queue_reset();
+			for (c = 0; c < 4000; ++c) {
+				const jack_nframes_t start = mock_cycle_start - mock_period;
+				uint32_t e;
+				for (e = 0; e < 4; ++e) {
+					my_midi_event_t event = { 0, 0, 0, 3, msg };
+					mock_now = start + rand() % mock_period;
+					if (k == 1) {
+						/* like '+0', due one period after now */
+						event.scheduled = 1;
+						event.time = mock_now + mock_period;
+					}
+					queue_event(&event);
+				}
+				mock_cycle();
+			}
+			drain();
+			lat_snapshot(&ls);
+			if (k == 0) {
+				printf("  period %-17u %10.0f %10.0f %10.0f", mock_period,
+						lat_quantile(&ls, .5) * us, lat_quantile(&ls, .99) * us, ls.max * us);
+			}
+		}
+		sched_max = ls.max;
+		printf(" %10.0f\n", sched_max * us);
+	}
+	mock_period = saved;
+}
+
+/* producer threads queue concurrently while the process callback runs.
+ * Each event carries its source, a sequence number and the stamp the
+ * queue gave it, so the output can be checked: every source keeps its
+ * order, and within a cycle the events are in the order of the stamps */
+#define PRODUCERS (MAX_SOURCES - 1) // the bench itself has the first
+#define PRODUCER_EVENTS (200000)
+#define PRODUCER_BURST (32)         // per step of mock_now
+
+static int producers_done = 0;
+
+static void put28(jack_midi_data_t *p, uint32_t v) {
+	uint32_t i;
+	for (i = 0; i < 4; ++i) {
+		p[i] = (v >> (7 * i)) & 0x7f;
+	}
+}
+
+static uint32_t get28(const jack_midi_data_t *p) {
+	return p[0] | (p[1] << 7) | (p[2] << 14) | ((uint32_t)p[3] << 21);
+}
+
+static void *producer(void *arg) {
+	const uint32_t id = (uintptr_t)arg;
+	jack_nframes_t step = __atomic_load_n(&mock_now, __ATOMIC_ACQUIRE);
+	uint32_t seq, n = 0;
+
+	for (seq = 0; seq < PRODUCER_EVENTS; ++seq) {
+		uint8_t *rec;
+		jack_nframes_t stamp;
+		while (n == PRODUCER_BURST && __atomic_load_n(&mock_now, __ATOMIC_ACQUIRE) == step) {
+			sched_yield();
+		}
+		if (n == PRODUCER_BURST) {
+			step = __atomic_load_n(&mock_now, __ATOMIC_ACQUIRE);
+			n = 0;
+		}
+		while (!(rec = queue_reserve(0, 0, 0, 12))) {
+			sched_yield(); // full, retry
+		}
+		/* the stamp precedes the data */
+		memcpy(&stamp, rec - sizeof(jack_nframes_t), sizeof(jack_nframes_t));
+		rec[0] = 0xf0;
+		rec[1] = 0x7d;
+		rec[2] = id;
+		put28(&rec[3], seq);
+		put28(&rec[7], stamp);
+		rec[11] = 0xf7;
+		queue_finish(12);
+		queue_count(1);
+		++n;
+	}
+	__atomic_fetch_add(&producers_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void bench_producers(void) {
+	pthread_t thread[PRODUCERS];
+	uint32_t next[PRODUCERS] = { 0 };
+	uint32_t received = 0, unordered = 0;
+	uint32_t i;
+	double t;
+
+	queue_reset();
+	t = now_sec();
+	for (i = 0; i < PRODUCERS; ++i) {
+		pthread_create(&thread[i], NULL, producer, (void *)(uintptr_t)i);
+	}
+	while (__atomic_load_n(&producers_done, __ATOMIC_ACQUIRE) < PRODUCERS || !all_sent()) {
+		const jack_nframes_t start = mock_cycle_start; // mock_cycle() moves mock_now there
+		void *out = jack_port_get_buffer(outs[0].port, mock_period);
+		jack_nframes_t last = 0;
+		uint32_t k, n;
+
+		for (k = 0; k < 8; ++k) {
+			__atomic_store_n(&mock_now, start + k * mock_period / 8, __ATOMIC_RELEASE);
+			usleep(20);
+		}
+		mock_cycle();
+
+		n = jack_midi_get_event_count(out);
+		for (k = 0; k < n; ++k) {
+			jack_midi_event_t ev;
+			uint32_t id, stamp;
+			jack_midi_event_get(&ev, out, k);
+			if (ev.size != 12 || (id = ev.buffer[2]) >= PRODUCERS) {
+				++unordered;
+				continue;
+			}
+			stamp = get28(&ev.buffer[7]);
+			if (get28(&ev.buffer[3]) != next[id]++ || (k > 0 && (int32_t)((stamp - last) << 4) < 0)) {
+				++unordered;
+			}
+			last = stamp;
+			++received;
+		}
+	}
+	t = now_sec() - t;
+	for (i = 0; i < PRODUCERS; ++i) {
+		pthread_join(thread[i], NULL);
+	}
+	printf("%u producer threads, %u events each\n", PRODUCERS, PRODUCER_EVENTS);
+	printf("  %-24s %12.0f\n", "events/s", received / t);
+	printf("  %-24s %12u\n", "lost", PRODUCERS * PRODUCER_EVENTS - received);
+	printf("  %-24s %12u\n", "out of order", unordered);
+}
+
+int main (int argc, char **argv) {
+	mock_buffer_size = 65536;
+	queue_size = 16384;
+	if (alloc_queues(queue_size) || init_jack("bench") || jack_portsetup()) {
+		return 1;
+	}
+
+	bench_parser();
+	bench_queue();
+	bench_buffer();
+	bench_latency();
+	bench_producers();
+
+	jack_client_close(j_client);
+	free_queues();
+	return 0;
+}
@@ -0,0 +1,284 @@
+/* minimal offline replacement for libjack
+ *
+ * Copyright (C) 2015 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jack_mock.h"
+
+#define MOCK_PORTS (66)
+
+jack_nframes_t mock_cycle_start = 0;
+jack_nframes_t mock_now = 0;
+jack_nframes_t mock_rate = 48000;
+jack_nframes_t mock_period = 1024;
+size_t mock_buffer_size = 32768;
+
+/* port buffer, laid out like JACK2's: a fixed size header per event
+ * that holds up to 4 bytes of data, larger data is stored separately */
+#define MOCK_EVENT_SIZE (12)
+#define MOCK_INLINE (4)
+
+typedef struct {
+	jack_nframes_t time;
+	uint32_t size;
+	uint32_t offset; // in data
+} mock_event_t;
+
+typedef struct {
+	jack_nframes_t nframes;
+	size_t used; // bytes, headers and data
+	uint32_t n;
+	uint32_t cap; // events
+	mock_event_t *ev;
+	jack_midi_data_t *data;
+	size_t data_used;
+} mock_buffer_t;
+
+struct _jack_port {
+	char name[64];
+	unsigned long flags;
+	mock_buffer_t buf;
+};
+
+struct _jack_client {
+	char name[32];
+	JackProcessCallback process;
+	void *arg;
+};
+
+static struct _jack_client client;
+static struct _jack_port ports[MOCK_PORTS];
+static uint32_t n_ports = 0;
+
+jack_client_t *jack_client_open(const char *name, jack_options_t options, jack_status_t *status, ...) {
+	snprintf(client.name, sizeof(client.name), "%s", name);
+	*status = 0;
+	return &client;
+}
+
+int jack_client_close(jack_client_t *c) {
+	uint32_t i;
+	for (i = 0; i < n_ports; ++i) {
+		free(ports[i].buf.ev);
+		free(ports[i].buf.data);
+	}
+	n_ports = 0;
+	return 0;
+}
+
+char *jack_get_client_name(jack_client_t *c) {
+	return c->name;
+}
+
+int jack_set_process_callback(jack_client_t *c, JackProcessCallback cb, void *arg) {
+	c->process = cb;
+	c->arg = arg;
+	return 0;
+}
+
+int jack_set_xrun_callback(jack_client_t *c, JackXRunCallback cb, void *arg) {
+	return 0;
+}
+
+void jack_on_shutdown(jack_client_t *c, JackShutdownCallback cb, void *arg) {
+}
+
+int jack_activate(jack_client_t *c) {
+	return 0;
+}
+
+jack_port_t *jack_port_register(jack_client_t *c, const char *name, const char *type, unsigned long flags, unsigned long size) {
+	jack_port_t *p;
+	if (n_ports >= MOCK_PORTS) {
+		return NULL;
+	}
+	p = &ports[n_ports++];
+	snprintf(p->name, sizeof(p->name), "%s:%s", c->name, name);
+	p->flags = flags;
+	p->buf.cap = mock_buffer_size / MOCK_EVENT_SIZE;
+	p->buf.ev = calloc(p->buf.cap, sizeof(mock_event_t));
+	p->buf.data = malloc(mock_buffer_size);
+	return p;
+}
+
+const char *jack_port_name(const jack_port_t *p) {
+	return p->name;
+}
+
+int jack_connect(jack_client_t *c, const char *src, const char *dst) {
+	return -1;
+}
+
+int jack_port_connected_to(const jack_port_t *p, const char *name) {
+	return 0;
+}
+
+jack_port_t *jack_port_by_name(jack_client_t *c, const char *name) {
+	uint32_t i;
+	for (i = 0; i < n_ports; ++i) {
+		if (!strcmp(ports[i].name, name)) {
+			return &ports[i];
+		}
+	}
+	return NULL;
+}
+
+int jack_port_is_mine(const jack_client_t *c, const jack_port_t *p) {
+	return 1;
+}
+
+/* there are no other clients */
+const char **jack_get_ports(jack_client_t *c, const char *pattern, const char *type, unsigned long flags) {
+	return NULL;
+}
+
+void jack_free(void *p) {
+	free(p);
+}
+
+int jack_set_port_registration_callback(jack_client_t *c, JackPortRegistrationCallback cb, void *arg) {
+	return 0;
+}
+
+int jack_set_graph_order_callback(jack_client_t *c, JackGraphOrderCallback cb, void *arg) {
+	return 0;
+}
+
+void *jack_port_get_buffer(jack_port_t *p, jack_nframes_t nframes) {
+	p->buf.nframes = nframes;
+	return &p->buf;
+}
+
+jack_nframes_t jack_get_sample_rate(jack_client_t *c) {
+	return mock_rate;
+}
+
+jack_nframes_t jack_get_buffer_size(jack_client_t *c) {
+	return mock_period;
+}
+
+jack_nframes_t jack_frame_time(const jack_client_t *c) {
+	return mock_now;
+}
+
+jack_nframes_t jack_last_frame_time(const jack_client_t *c) {
+	return mock_cycle_start;
+}
+
+int jack_is_realtime(jack_client_t *c) {
+	return 0;
+}
+
+int jack_client_real_time_priority(jack_client_t *c) {
+	return 0;
+}
+
+float jack_cpu_load(jack_client_t *c) {
+	return 0;
+}
+
+jack_transport_state_t jack_transport_query(const jack_client_t *c, jack_position_t *pos) {
+	if (pos) {
+		memset(pos, 0, sizeof(*pos));
+		pos->frame_rate = mock_rate;
+	}
+	return JackTransportStopped;
+}
+
+void jack_transport_start(jack_client_t *c) {
+}
+
+void jack_transport_stop(jack_client_t *c) {
+}
+
+int jack_transport_locate(jack_client_t *c, jack_nframes_t frame) {
+	return 0;
+}
+
+void jack_midi_clear_buffer(void *b) {
+	mock_buffer_t *m = b;
+	m->n = 0;
+	m->used = 0;
+	m->data_used = 0;
+}
+
+uint32_t jack_midi_get_event_count(void *b) {
+	return ((mock_buffer_t *)b)->n;
+}
+
+int jack_midi_event_get(jack_midi_event_t *ev, void *b, uint32_t i) {
+	mock_buffer_t *m = b;
+	if (i >= m->n) {
+		return -1;
+	}
+	ev->time = m->ev[i].time;
+	ev->size = m->ev[i].size;
+	ev->buffer = &m->data[m->ev[i].offset];
+	return 0;
+}
+
+jack_midi_data_t *jack_midi_event_reserve(void *b, jack_nframes_t time, size_t size) {
+	mock_buffer_t *m = b;
+	const size_t need = MOCK_EVENT_SIZE + (size > MOCK_INLINE ? size : 0);
+	jack_midi_data_t *data;
+	if (time >= m->nframes || (m->n > 0 && time < m->ev[m->n - 1].time)) {
+		return NULL;
+	}
+	if (m->used + need > mock_buffer_size || m->n >= m->cap) {
+		return NULL;
+	}
+	m->ev[m->n].time = time;
+	m->ev[m->n].size = size;
+	m->ev[m->n].offset = m->data_used;
+	data = &m->data[m->data_used];
+	m->data_used += size;
+	m->used += need;
+	++m->n;
+	return data;
+}
+
+int jack_midi_event_write(void *b, jack_nframes_t time, const jack_midi_data_t *data, size_t size) {
+	jack_midi_data_t *buf = jack_midi_event_reserve(b, time, size);
+	if (!buf) {
+		return -105; // ENOBUFS
+	}
+	memcpy(buf, data, size);
+	return 0;
+}
+
+uint32_t mock_port_events(uint32_t n) {
+	return n < n_ports ? ports[n].buf.n : 0;
+}
+
+void mock_cycle(void) {
+	uint32_t i;
+	for (i = 0; i < n_ports; ++i) {
+		if (ports[i].flags & JackPortIsInput) {
+			jack_midi_clear_buffer(&ports[i].buf);
+		}
+	}
+	if (client.process) {
+		client.process(mock_period, client.arg);
+	}
+	mock_cycle_start += mock_period;
+	if ((int32_t)(mock_now - mock_cycle_start) < 0) {
+		mock_now = mock_cycle_start;
+	}
+}
@@ -0,0 +1,40 @@
+/* minimal offline replacement for libjack, see jack_mock.c
+ *
+ * Copyright (C) 2015 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef JACK_MOCK_H
+#define JACK_MOCK_H
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+/* simulated time, set by the driver */
+extern jack_nframes_t mock_cycle_start; // jack_last_frame_time()
+extern jack_nframes_t mock_now;         // jack_frame_time()
+extern jack_nframes_t mock_rate;
+extern jack_nframes_t mock_period;
+
+/* capacity of each port buffer in bytes, as with jackd -p ... */
+extern size_t mock_buffer_size;
+
+/* events written to the n-th registered port in the last cycle */
+uint32_t mock_port_events(uint32_t n);
+
+/* call the process callback for one cycle of `mock_period` frames,
+ * and advance the time */
+void mock_cycle(void);
+
+#endif
@@ -16,7 +16,14 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define JACK_MIDI_QUEUE_SIZE (256)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setaffinity_np()
+#endif
+
+#define JACK_MIDI_QUEUE_SIZE (4096) // default, rounded up to a power of two
+#define JACK_MIDI_QUEUE_MAX (1 << 24)
+#define MAX_PORTS (64)
+#define CACHELINE_SIZE (64)
 
 #ifdef WIN32
 #include <windows.h>
@@ -30,20 +37,38 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
 #include <time.h>
 #include <getopt.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <jack/jack.h>
-#include <jack/ringbuffer.h>
 #include <jack/midiport.h>
 
 #ifndef WIN32
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
+#include <regex.h>
+#endif
+
+#ifdef __linux__
+#include <sys/signalfd.h>
+#endif
+
+#ifdef HAVE_READLINE
+#include <readline/readline.h>
+#include <readline/history.h>
 #endif
 
-static jack_port_t *midi_output_port = NULL;
 static jack_client_t *j_client = NULL;
 
 /* a simple state machine for this client */
@@ -52,277 +77,5858 @@ static volatile enum {
 		Exit
 } client_state = Run;
 
+/* wake up the main loop, see control_loop() */
+static int wakeup_pipe[2] = { -1, -1 };
+
+static void wakeup_main(void) {
+	if (wakeup_pipe[1] >= 0) {
+		ssize_t rv = write(wakeup_pipe[1], "", 1);
+		(void) rv;
+	}
+}
+
+/* what to do when the event queue is full */
+static enum {
+	OverflowDrop,
+	OverflowBlock
+} overflow_policy = OverflowDrop;
+static int overflow_set = 0;
+
+/* no stdin and prompt, commands arrive on the --listen sockets and fifos */
+static int daemon_mode = 0;
+
+/* non-interactive mode: read all input, exit once it has been sent */
+static int batch = 0;
+static const char *batch_file = NULL;
+static jack_nframes_t batch_start = 0; // time-base for relative timestamps
+
+/* binary input, see usage() */
+static enum {
+	BinaryOff,
+	BinaryRaw,
+	BinaryTimed
+} binary_mode = BinaryOff;
+
+/* event statistics, each counter has a single writer,
+ * except for the input threads' which are updated atomically */
+static struct {
+	uint32_t queued;        // input threads
+	uint32_t ring_full;     // input threads: dropped, queue was full
+	uint32_t sent;          // process: written to the port
+	uint32_t late;          // process: sent after their due time
+	uint32_t port_deferred; // process: port buffer full, retried next cycle
+	uint32_t port_dropped;  // process: event does not fit into port buffer
+	uint32_t received;      // process: from the input port
+	uint32_t in_dropped;    // process: input queue was full, during a 'wait'
+	uint32_t thru;          // process: forwarded from input to output
+	uint32_t thru_dropped;  // process: thru event did not fit
+	uint32_t generated;     // process: clock and patterns
+	uint32_t coalesced;     // process: replaced by a later value in the same cycle
+	uint32_t wire_bytes;    // process: sent, as bytes on a DIN link with running status
+	uint32_t rate_limited;  // process: port cycles that deferred events over the byte-rate
+	uint32_t budget_limited; // process: port cycles that deferred events over the budget
+	uint32_t xruns;         // jack xrun callback
+} stats;
+
+/* latency of sent events, in frames from the time they were queued
+ * (or their due time, if that is later) to the time they are sent.
+ * Written by the process callback only, log-linear buckets with
+ * 8 steps per octave. */
+#define LAT_BUCKETS (16 + 28 * 8)
+
+static struct {
+	uint32_t bucket[LAT_BUCKETS];
+	uint32_t count;
+	uint32_t max;
+	uint64_t sum;
+	uint32_t cycles;     // with at least one event sent
+	uint32_t events_max; // per cycle
+} latency;
+
+static inline uint32_t lat_bucket(uint32_t frames) {
+	uint32_t e;
+	if (frames < 16) {
+		return frames;
+	}
+	e = 31 - __builtin_clz(frames);
+	return 16 + (e - 4) * 8 + ((frames >> (e - 3)) & 7);
+}
+
+/* largest value in a bucket */
+static uint32_t lat_bucket_max(uint32_t i) {
+	uint32_t e;
+	if (i < 16) {
+		return i;
+	}
+	e = (i - 16) / 8 + 4;
+	return (uint32_t)(((uint64_t)(8 + (i - 16) % 8 + 1) << (e - 3)) - 1);
+}
+
+static inline void lat_record(int32_t frames) {
+	const uint32_t v = frames > 0 ? frames : 0;
+	const uint32_t b = lat_bucket(v);
+	__atomic_store_n(&latency.bucket[b], latency.bucket[b] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&latency.sum, latency.sum + v, __ATOMIC_RELAXED);
+	if (v > latency.max) {
+		__atomic_store_n(&latency.max, v, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&latency.count, latency.count + 1, __ATOMIC_RELAXED);
+}
+
+/* wake up a producer that waits for space in the queue,
+ * or for events to be sent */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_drained = PTHREAD_COND_INITIALIZER;
+
 typedef struct my_midi_event {
-	jack_nframes_t time;
+	jack_nframes_t time; // absolute jack frame-time, if scheduled
+	int scheduled;       // 0: send as soon as possible
+	uint32_t port;       // output port index
 	size_t size;
-	jack_midi_data_t buffer[16];
+	const jack_midi_data_t *buffer;
 } my_midi_event_t;
 
-static my_midi_event_t event_queue[JACK_MIDI_QUEUE_SIZE];
-static int queued_events_start = 0;
-static int queued_events_end = 0;
-
-/**
- * cleanup and exit
- * call this function only _after_ everything has been initialized!
+/* lock-free single-producer, single-consumer event queue
+ * (input thread -> jack process callback), one per output port and
+ * producer thread. Each thread that queues events gets its own set on
+ * first use, so producers never wait for each other, see source_claim().
+ * The process callback merges them in the order the events were queued.
+ *
+ * A byte-stream ring of length-prefixed records:
+ *   varint   (size << EV_FLAGBITS) | flags
+ *   uint32   due frame-time, only if (flags & EV_SCHEDULED)
+ *   uint32   frame-time when it was queued, only if (flags & EV_STAMPED)
+ *   uint8    owner, only if (flags & EV_OWNED), see owner_claim()
+ *   uint8    data[size]
+ * A 3 byte message takes 8 bytes (12 if scheduled). Records are never
+ * split at the end of the buffer, a zero header byte marks padding
+ * up to the wrap-around point.
+ *
+ * head and tail are free-running byte counters, each on its own cache-line.
+ * The producer writes a record and then publishes it with a release-store of
+ * `head`, the consumer acquires `head` before reading the record and hands
+ * the space back with a release-store of `tail`. Between queue_begin()
+ * and queue_commit() records are written but not published, so the
+ * process callback sees all of them in the same cycle, or none.
+ *
+ * The queues, the schedulers and the sysex pools below are allocated and
+ * locked at startup, see alloc_queues().
  */
-static void cleanup(int sig) {
-	if (j_client) {
-		jack_client_close (j_client);
-		j_client=NULL;
+#define EV_SCHEDULED (1)
+#define EV_CONTROL   (2) // data is a command for the process callback
+#define EV_STAMPED   (4) // for latency statistics
+#define EV_OWNED     (8) // a client's, counted for its 'wait'
+#define EV_FLAGBITS  (4)
+
+/* control records, the first data byte */
+enum {
+	CtlMacro,
+	CtlClock,
+	CtlPattern
+};
+
+typedef struct {
+	uint32_t head;  // written by producer only
+	uint32_t write; // producer: end of records not yet published
+	char _pad0[CACHELINE_SIZE - 2 * sizeof(uint32_t)];
+	uint32_t tail; // written by consumer only
+	char _pad1[CACHELINE_SIZE - sizeof(uint32_t)];
+	uint32_t size; // power of two
+	uint32_t mask;
+	uint8_t *buf;
+} __attribute__ ((aligned (CACHELINE_SIZE))) event_queue_t;
+
+/* unsigned LEB128 */
+static inline uint32_t varint_len(uint32_t v) {
+	uint32_t len = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		++len;
 	}
-	fprintf(stderr, "bye.\n");
+	return len;
 }
 
-/**
- * jack audio process callback
- */
-int process (jack_nframes_t nframes, void *arg) {
-	void *out = jack_port_get_buffer(midi_output_port, nframes);
-	jack_midi_clear_buffer(out);
-
-	while (queued_events_end != queued_events_start) {
-		jack_midi_event_write(out,
-				event_queue[queued_events_end].time,
-				event_queue[queued_events_end].buffer,
-				event_queue[queued_events_end].size
-				);
-		queued_events_end = (queued_events_end + 1) % JACK_MIDI_QUEUE_SIZE;
+static inline uint32_t varint_write(uint8_t *p, uint32_t v) {
+	uint32_t len = 0;
+	while (v >= 0x80) {
+		p[len++] = (v & 0x7f) | 0x80;
+		v >>= 7;
 	}
-	return 0;
+	p[len++] = v;
+	return len;
 }
 
-void jack_shutdown (void *arg) {
-	fprintf(stderr,"recv. shutdown request from jackd.\n");
-	client_state=Exit;
+static inline uint32_t varint_read(const uint8_t *p, uint32_t *v) {
+	uint32_t len = 0;
+	*v = 0;
+	do {
+		*v |= (uint32_t)(p[len] & 0x7f) << (7 * len);
+	} while (p[len++] & 0x80);
+	return len;
 }
 
-/**
- * open a client connection to the JACK server
- */
-static int init_jack(const char *client_name) {
-	jack_status_t status;
-	j_client = jack_client_open (client_name, JackNullOption, &status);
-	if (j_client == NULL) {
-		fprintf (stderr, "jack_client_open() failed, status = 0x%2.0x\n", status);
-		if (status & JackServerFailed) {
-			fprintf (stderr, "Unable to connect to JACK server\n");
-		}
-		return (-1);
+/* returns the number of padding bytes to skip before a record of `len`
+ * bytes can be written, or -1 if the queue is full */
+static inline int64_t queue_space(const event_queue_t *q, uint32_t len) {
+	const uint32_t head = q->write;
+	const uint32_t avail = q->size - (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE));
+	const uint32_t contiguous = q->size - (head & q->mask);
+	const uint32_t pad = contiguous < len ? contiguous : 0;
+	return avail < pad + len ? -1 : (int64_t)pad;
+}
+
+/* write the header of a record at q->write, after checking the space
+ * with queue_space(). Returns where the data goes, the caller writes it
+ * in place and advances q->write by its size */
+static inline uint8_t *queue_put_header(event_queue_t *q, int64_t pad, uint32_t hdr, jack_nframes_t time, jack_nframes_t stamp) {
+	uint32_t head = q->write;
+	uint8_t *rec;
+	if (pad > 0) {
+		q->buf[head & q->mask] = 0;
+		head += pad;
 	}
-	if (status & JackNameNotUnique) {
-		client_name = jack_get_client_name(j_client);
-		fprintf (stderr, "jack-client name: `%s'\n", client_name);
+	rec = &q->buf[head & q->mask];
+	rec += varint_write(rec, hdr);
+	if (hdr & EV_SCHEDULED) {
+		memcpy(rec, &time, sizeof(jack_nframes_t));
+		rec += sizeof(jack_nframes_t);
 	}
-	jack_set_process_callback (j_client, process, 0);
-	jack_on_shutdown (j_client, jack_shutdown, NULL);
-	return (0);
+	if (hdr & EV_STAMPED) {
+		memcpy(rec, &stamp, sizeof(jack_nframes_t));
+		rec += sizeof(jack_nframes_t);
+	}
+	q->write = head + (rec - &q->buf[head & q->mask]);
+	return rec;
 }
 
-static int jack_portsetup(void) {
-	if ((midi_output_port = jack_port_register(j_client, "out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0)) == 0) {
-		fprintf (stderr, "cannot register midi ouput port !\n");
-		return (-1);
-	}
-	return (0);
+static inline void queue_put(event_queue_t *q, int64_t pad, uint32_t hdr, jack_nframes_t time, jack_nframes_t stamp, const uint8_t *data, uint32_t size) {
+	memcpy(queue_put_header(q, pad, hdr, time, stamp), data, size);
+	q->write += size;
 }
 
-static void port_connect(char *midi_port) {
-	if (midi_port && jack_connect(j_client, jack_port_name(midi_output_port), midi_port)) {
-		fprintf(stderr, "cannot connect port %s to %s\n", jack_port_name(midi_output_port), midi_port);
+/* consumer: returns the length of the record at `at`, from q->tail up to
+ * `head`, after skipping padding. 0 if there is none.
+ * Records are released by advancing q->tail */
+static inline uint32_t queue_peek(const event_queue_t *q, uint32_t *at, uint32_t head, uint32_t *hdr, jack_nframes_t *time, const uint8_t **data) {
+	uint32_t pos, len;
+	if (*at == head) {
+		return 0;
+	}
+	pos = *at & q->mask;
+	if (q->buf[pos] == 0) {
+		*at += q->size - pos; // padding
+		if (*at == head) {
+			return 0;
+		}
+		pos = 0;
+	}
+	len = varint_read(&q->buf[pos], hdr);
+	if (*hdr & EV_SCHEDULED) {
+		memcpy(time, &q->buf[pos + len], sizeof(jack_nframes_t));
+		len += sizeof(jack_nframes_t);
 	}
+	if (*hdr & EV_STAMPED) {
+		len += sizeof(jack_nframes_t);
+	}
+	*data = &q->buf[pos + len];
+	return len + (*hdr >> EV_FLAGBITS);
 }
 
-void catchsig (int sig) {
-#ifndef _WIN32
-	signal(SIGHUP, catchsig);
-#endif
-	fprintf(stderr,"caught signal - shutting down.\n");
-	client_state=Exit;
-}
+/* pending events of each port, owned by the process callback.
+ *
+ * A binary min-heap ordered by due frame-time; events due at the
+ * same time retain the order in which they were queued (seq).
+ * Messages of up to SCHED_INLINE bytes are kept in the heap itself,
+ * larger ones (sysex) in the port's sysex pool.
+ * It's allocated at startup, so no allocation (or page-fault with
+ * mlockall) happens in the rt-thread.
+ */
+#define SCHED_INLINE (8)
 
-/**************************
- * main application code
+typedef struct {
+	jack_nframes_t time;
+	jack_nframes_t stamp; // earliest time it could be sent, for latency
+	uint32_t seq;
+	uint32_t size;
+	union {
+		jack_midi_data_t data[SCHED_INLINE];
+		uint32_t pool; // offset in the sysex pool, if size > SCHED_INLINE
+	};
+	uint8_t owner; // see owners[], 0: none
+} sched_event_t;
+
+/* storage for large scheduled messages, owned by the process callback.
+ *
+ * Blocks are allocated contiguously at `head` and released from `tail`,
+ * blocks that are freed early are reclaimed once all older ones are freed.
+ * Each block starts with a pool_block_t header and is 8 byte aligned.
  */
+typedef struct {
+	uint32_t len;  // total length of the block, including this header
+	uint32_t done; // block was freed (or is padding)
+} pool_block_t;
 
-static struct option const long_options[] =
-{
-	{"help", no_argument, 0, 'h'},
-	{"version", no_argument, 0, 'V'},
-	{NULL, 0, NULL, 0}
-};
+typedef struct {
+	uint8_t *buf;
+	uint32_t size;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t used;
+} sysex_pool_t;
 
-static void usage (int status) {
-	printf ("jack_midi_command - JACK app to generate custom MIDI messages.\n\n");
-	printf ("Usage: jack_midi_command [ OPTIONS ] [JACK-port]*\n\n");
-	printf ("Options:\n\
-			-h, --help                 display this help and exit\n\
-			-V, --version              print version information and exit\n\
-			\n");
-	printf ("\n\
-			This tool generates generates custom midi message from stdin\n\
-			and sends them to a JACK-midi port.\n\
-			\n");
-	printf ("Report bugs to Robin Gareus <robin@gareus.org>\n"
-			"Website and manual: <https://github.com/x42/jack-midi-cmd>\n"
-			);
-	exit (status);
-}
+typedef struct {
+	sched_event_t *heap;
+	uint32_t size;
+	uint32_t len;
+	uint32_t seq;
+	sysex_pool_t pool;
+} sched_t;
 
-static int decode_switches (int argc, char **argv) {
-	int c;
+/* producer threads; stdin and the control sockets share the first,
+ * each OSC listener has its own thread, see osc_thread() */
+#define MAX_SOURCES (4)
 
-	while ((c = getopt_long (argc, argv,
-					"h"	/* help */
-					"V",	/* version */
-					long_options, (int *) 0)) != EOF)
-	{
-		switch (c)
-		{
+/* an output port with its own queues and scheduler */
+typedef struct {
+	event_queue_t queue[MAX_SOURCES];
+	sched_t sched;
+	jack_port_t *port;
+	uint8_t running_status; // process: last channel status sent, 0: none
+	double link_free;       // process: frame (see frame64()) when the link is idle
+} midi_out_t;
 
-			case 'V':
-				printf ("jack_midi_command version %s\n\n", VERSION);
-				printf ("Copyright (C) GPL 2015 Robin Gareus <robin@gareus.org>\n");
-				exit (0);
+static midi_out_t *outs = NULL;
+static uint32_t n_outs = 1;
+static uint32_t queue_bytes = 0; // size of each output queue
 
-			case 'h':
-				usage (0);
+static int n_sources = 0;            // claimed, see source_claim()
+static __thread int queue_src = -1;  // this thread's queues, -2: none left
 
-			default:
-				usage (EXIT_FAILURE);
+/* MIDI input, process callback -> control thread.
+ * Uses the event queue's record format, every record is time-stamped. */
+static struct {
+	event_queue_t queue;
+	jack_port_t *port;
+	int enabled;
+	int waiting;              // control thread waits for a reply
+} midi_in;
+
+/* messages of each client, for its 'wait'. The control thread tags
+ * the records a client queues with an owner id and counts them, the
+ * process callback counts them once sent, dropped or coalesced. */
+#define MAX_OWNERS (256) // 0: not counted
+
+static struct {
+	uint32_t done;            // process
+	jack_nframes_t last_sent; // process: time of the last one sent
+} owners[MAX_OWNERS];
+
+/* process: `n` messages of `owner` were dropped, or sent at `time` */
+static inline void owner_done(uint8_t owner, uint32_t n, int sent, jack_nframes_t time) {
+	if (owner) {
+		if (sent) {
+			__atomic_store_n(&owners[owner].last_sent, time, __ATOMIC_RELAXED);
 		}
+		__atomic_store_n(&owners[owner].done, owners[owner].done + n, __ATOMIC_RELEASE);
 	}
-
-	return optind;
 }
 
-static void queue_event(my_midi_event_t *me) {
-	if (((queued_events_start + 1) % JACK_MIDI_QUEUE_SIZE) == queued_events_end) {
-		return;
+static int max_sysex = 8192;
+
+/* wrap-around safe: is a due before b */
+static inline int sched_before(const sched_event_t *a, const sched_event_t *b) {
+	const int32_t d = (int32_t)(a->time - b->time);
+	if (d != 0) {
+		return d < 0;
 	}
-	memcpy(&event_queue[queued_events_start], me, sizeof(my_midi_event_t));
-	queued_events_start = (queued_events_start + 1) % JACK_MIDI_QUEUE_SIZE;
+	return (int32_t)(a->seq - b->seq) < 0;
 }
 
-static int parse_message(const char *msg) {
-	int param[3];
-	my_midi_event_t event;
+/* returns offset of the data in the pool, or -1 if the pool is full */
+static int64_t pool_alloc(sysex_pool_t *pool, uint32_t size) {
+	const uint32_t len = (sizeof(pool_block_t) + size + 7) & ~7;
+	pool_block_t *blk;
 
-	event.time = 0;
+	if (pool->used == 0) {
+		pool->head = pool->tail = 0;
+	}
 
-#define THREEBYTES(A, B, C)       \
-	event.size = 3;               \
-	event.buffer[0] = (A) & 0xff; \
-	event.buffer[1] = (B) & 0x7f; \
-	event.buffer[2] = (C) & 0x7f; \
-	queue_event(&event);
+	if (pool->head < pool->tail || pool->used == pool->size) {
+		if (pool->tail - pool->head < len) {
+			return -1;
+		}
+	} else if (pool->size - pool->head < len) {
+		/* pad to the end, and continue at the start */
+		if (pool->tail < len) {
+			return -1;
+		}
+		blk = (pool_block_t*) &pool->buf[pool->head];
+		blk->len = pool->size - pool->head;
+		blk->done = 1;
+		pool->used += blk->len;
+		pool->head = 0;
+	}
 
-	if (!strncmp(msg, "exit", 4)) {
-		client_state = Exit;
+	const uint32_t offset = pool->head;
+	blk = (pool_block_t*) &pool->buf[offset];
+	blk->len = len;
+	blk->done = 0;
+	pool->used += len;
+	pool->head += len;
+	if (pool->head == pool->size) {
+		pool->head = 0;
 	}
-	else if (!strncmp(msg, "reconnect", 9)) {
-		return 1;
+	return offset + sizeof(pool_block_t);
+}
+
+static void pool_free(sysex_pool_t *pool, uint32_t offset) {
+	pool_block_t *blk = (pool_block_t*) &pool->buf[offset - sizeof(pool_block_t)];
+	blk->done = 1;
+	while (pool->used > 0) {
+		blk = (pool_block_t*) &pool->buf[pool->tail];
+		if (!blk->done) {
+			break;
+		}
+		pool->used -= blk->len;
+		pool->tail += blk->len;
+		if (pool->tail == pool->size) {
+			pool->tail = 0;
+		}
 	}
-	else if (!strncmp(msg, "help", 4)) {
-		printf(" -- Sorry, help yourself and read the source.\n");
+}
+
+static inline const jack_midi_data_t *sched_data(const sched_t *s, const sched_event_t *ev) {
+	if (ev->size > SCHED_INLINE) {
+		return &s->pool.buf[ev->pool];
 	}
-	// TODO add a more creative parser
-	else if (3 == sscanf(msg, ". %x %x %x\n", &param[0], &param[1], &param[2])) {
-		THREEBYTES(param[0], param[1], param[2])
+	return ev->data;
+}
+
+/* insert with the given order among events due at the same time,
+ * returns -1 if there is no space for the event */
+static int sched_insert(sched_t *s, jack_nframes_t time, jack_nframes_t stamp, uint32_t seq, const jack_midi_data_t *data, uint32_t size, uint8_t owner) {
+	sched_event_t ev;
+	uint32_t i;
+
+	if (s->len >= s->size) {
+		return -1;
 	}
-	else if (2 == sscanf(msg, "CC %i %i\n", &param[0], &param[1])) {
-		THREEBYTES(0xb0, param[0], param[1])
+
+	ev.time = time;
+	ev.stamp = stamp;
+	ev.seq = seq;
+	ev.size = size;
+	ev.owner = owner;
+	if (size > SCHED_INLINE) {
+		const int64_t offset = pool_alloc(&s->pool, size);
+		if (offset < 0) {
+			return -1;
+		}
+		ev.pool = offset;
+		memcpy(&s->pool.buf[offset], data, size);
+	} else {
+		memcpy(ev.data, data, size);
 	}
-	else if (2 == sscanf(msg, "N %i %i\n", &param[0], &param[1])) {
-		THREEBYTES(0x90, param[0], param[1])
+
+	i = s->len++;
+	/* sift up, move parents into the hole */
+	while (i > 0) {
+		const uint32_t parent = (i - 1) / 2;
+		if (!sched_before(&ev, &s->heap[parent])) {
+			break;
+		}
+		s->heap[i] = s->heap[parent];
+		i = parent;
 	}
-	else if (2 == sscanf(msg, "n %i %i\n", &param[0], &param[1])) {
-		THREEBYTES(0x80, param[0], param[1])
+	s->heap[i] = ev;
+	return 0;
+}
+
+/* returns -1 if there is no space for the event */
+static int sched_push(sched_t *s, jack_nframes_t time, jack_nframes_t stamp, const jack_midi_data_t *data, uint32_t size, uint8_t owner) {
+	if (sched_insert(s, time, stamp, s->seq, data, size, owner)) {
+		return -1;
 	}
-	else if (2 == sscanf(msg, "2 %i %i\n", &param[0], &param[1])) {
-		event.size = 2;
-		event.buffer[0] =  param[0] & 0xff;
-		event.buffer[1] =  param[1] & 0x7f;
-		queue_event(&event);
+	++s->seq;
+	return 0;
+}
+
+static void sched_pop(sched_t *s) {
+	const sched_event_t *last = &s->heap[--s->len];
+	uint32_t i = 0;
+
+	if (s->heap[0].size > SCHED_INLINE) {
+		pool_free(&s->pool, s->heap[0].pool);
 	}
-	else if (1 == sscanf(msg, "1 %i\n", &param[0])) {
-		event.size = 1;
-		event.buffer[0] =  param[0] & 0xff;
-		queue_event(&event);
+
+	/* sift down, move the smaller child into the hole */
+	while (1) {
+		uint32_t child = 2 * i + 1;
+		if (child >= s->len) {
+			break;
+		}
+		if (child + 1 < s->len && sched_before(&s->heap[child + 1], &s->heap[child])) {
+			++child;
+		}
+		if (!sched_before(&s->heap[child], last)) {
+			break;
+		}
+		s->heap[i] = s->heap[child];
+		i = child;
 	}
-	else {
-		printf(" -- Invalid Message, try 'help'\n");
+	if (i != s->len) {
+		s->heap[i] = *last;
 	}
-	return 0;
 }
 
-int main (int argc, char **argv) {
-	fd_set rfds;
-	struct timeval tv;
-	int cns;
-	char buf[1024] = "";
+/**
+ * allocate, lock and pre-fault memory used by the rt-thread
+ */
+static void *alloc_locked(size_t bytes) {
+	void *p;
+	if (posix_memalign(&p, CACHELINE_SIZE, bytes)) {
+		return NULL;
+	}
+	memset(p, 0, bytes);
+#ifndef WIN32
+	if (mlock(p, bytes)) {
+		fprintf(stderr, "Warning: Can not lock queue memory.\n");
+	}
+#endif
+	return p;
+}
 
-	decode_switches (argc, argv);
+static uint32_t next_pow2(uint32_t v) {
+	uint32_t pow2 = 1;
+	while (pow2 < v) {
+		pow2 <<= 1;
+	}
+	return pow2;
+}
 
-	// -=-=-= INITIALIZE =-=-=-
+/**
+ * allocate the output ports' event queue, scheduler and sysex pool.
+ * `size` is the max. number of events per port, the queue is sized in
+ * bytes to hold that many 3-byte scheduled messages, or two of the
+ * largest sysex messages.
+ */
+static int alloc_queues(uint32_t size) {
+	uint32_t bytes = size * 12;
+	uint32_t i;
+	if (bytes < 2 * (uint32_t)(max_sysex + 8)) {
+		bytes = 2 * (max_sysex + 8);
+	}
+	bytes = next_pow2(bytes);
+	queue_bytes = bytes;
 
-	if (init_jack("midicmd"))
-		goto out;
-	if (jack_portsetup())
-		goto out;
+	if (!(outs = alloc_locked(n_outs * sizeof(midi_out_t)))) {
+		fprintf(stderr, "cannot allocate event queue.\n");
+		return -1;
+	}
+	for (i = 0; i < n_outs; ++i) {
+		midi_out_t *o = &outs[i];
+		o->queue[0].buf = alloc_locked(bytes);
+		o->sched.heap = alloc_locked(next_pow2(size) * sizeof(sched_event_t));
+		o->sched.pool.buf = alloc_locked(bytes);
+		if (!o->queue[0].buf || !o->sched.heap || !o->sched.pool.buf) {
+			fprintf(stderr, "cannot allocate event queue.\n");
+			return -1;
+		}
+		o->queue[0].size = bytes;
+		o->queue[0].mask = bytes - 1;
+		o->sched.size = next_pow2(size);
+		o->sched.pool.size = bytes;
+	}
+	if (midi_in.enabled) {
+		if (!(midi_in.queue.buf = alloc_locked(bytes))) {
+			fprintf(stderr, "cannot allocate input queue.\n");
+			return -1;
+		}
+		midi_in.queue.size = bytes;
+		midi_in.queue.mask = bytes - 1;
+	}
+	return 0;
+}
 
-	if (mlockall (MCL_CURRENT | MCL_FUTURE)) {
-		fprintf(stderr, "Warning: Can not lock memory.\n");
+static void free_queues(void) {
+	uint32_t i;
+	if (!outs) {
+		return;
+	}
+	for (i = 0; i < n_outs; ++i) {
+		int s;
+		for (s = 0; s < MAX_SOURCES; ++s) {
+			free(outs[i].queue[s].buf);
+		}
+		free(outs[i].sched.heap);
+		free(outs[i].sched.pool.buf);
 	}
+	free(outs);
+	outs = NULL;
+	free(midi_in.queue.buf);
+	midi_in.queue.buf = NULL;
+}
 
-	// -=-=-= RUN =-=-=-
+/* Standard MIDI File playback, following jack transport.
+ *
+ * All tracks are merged into a flat array, sorted by time, with the
+ * message data stored in the same order. It's immutable after loading,
+ * the playback state below is owned by the process callback.
+ */
+typedef struct {
+	jack_nframes_t frame; // from the start of the file
+	uint32_t size;
+	uint32_t data;        // offset in smf.data
+} smf_event_t;
 
-	if (jack_activate (j_client)) {
-		fprintf (stderr, "cannot activate client.\n");
-		goto out;
-	}
+static struct {
+	smf_event_t *events;
+	uint32_t n_events;
+	jack_midi_data_t *data;
+	uint16_t channels;       // bitmask of channels in use
+	/* playback */
+	uint32_t pos;            // index of the next event
+	jack_nframes_t expected; // transport position of the next cycle
+	int rolling;
+} smf;
 
-	cns = optind;
-	while (cns < argc)
-		port_connect(argv[cns++]);
+/* first event at or after `frame` */
+static uint32_t smf_seek(jack_nframes_t frame) {
+	uint32_t lo = 0;
+	uint32_t hi = smf.n_events;
+	while (lo < hi) {
+		const uint32_t mid = lo + (hi - lo) / 2;
+		if (smf.events[mid].frame < frame) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
 
-#ifndef _WIN32
-	signal (SIGHUP, catchsig);
-	signal (SIGINT, catchsig);
-#endif
+/* silence hanging notes on stop and relocate */
+static void smf_notes_off(jack_nframes_t time) {
+	int c;
+	for (c = 0; c < 16; ++c) {
+		const jack_midi_data_t sustain_off[3] = { 0xb0 | c, 0x40, 0x00 };
+		const jack_midi_data_t all_notes_off[3] = { 0xb0 | c, 0x7b, 0x00 };
+		if (!(smf.channels & (1 << c))) {
+			continue;
+		}
+		sched_push(&outs[0].sched, time, time, sustain_off, 3, 0);
+		sched_push(&outs[0].sched, time, time, all_notes_off, 3, 0);
+	}
+}
 
-	// -=-=-= JACK DOES ALL THE WORK =-=-=-
+/**
+ * move events of the current cycle to the scheduler of the first port
+ */
+static void smf_process(jack_nframes_t cycle_start, jack_nframes_t nframes) {
+	jack_position_t pos;
 
+	if (!smf.events) {
+		return;
+	}
 
-	printf("\n> "); fflush(stdout);
-	while (client_state != Exit) {
-		FD_ZERO(&rfds);
-		FD_SET(STDIN_FILENO, &rfds);
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
-		// history would ne nice :) -> readline ? does it work x-platform?
-		int rv = select(STDIN_FILENO + 1, &rfds, NULL, NULL, &tv);
-		if (rv < 0) { break; }
-		if (rv == 0 || !FD_ISSET(STDIN_FILENO, &rfds)) { continue; }
-		if (!fgets(buf, 1024, stdin)) {
-			break;
-		}
-		switch (parse_message(buf)) {
-			case 1:
-				cns = optind;
-				while (cns < argc)
-					port_connect(argv[cns++]);
-				break;
-			default:
-				break;
+	if (jack_transport_query(j_client, &pos) != JackTransportRolling) {
+		if (smf.rolling) {
+			smf.rolling = 0;
+			smf_notes_off(cycle_start);
 		}
-		printf("> "); fflush(stdout);
+		return;
 	}
-	printf("\n");
 
-	// -=-=-= CLEANUP =-=-=-
+	if (!smf.rolling || pos.frame != smf.expected) {
+		if (smf.rolling) {
+			smf_notes_off(cycle_start);
+		}
+		smf.pos = smf_seek(pos.frame);
+		smf.rolling = 1;
+	}
+	smf.expected = pos.frame + nframes;
 
-out:
-	cleanup(0);
-	return(0);
+	while (smf.pos < smf.n_events) {
+		const smf_event_t *ev = &smf.events[smf.pos];
+		const jack_nframes_t time = cycle_start + ev->frame - pos.frame;
+		if (ev->frame >= pos.frame + nframes) {
+			break;
+		}
+		if (sched_push(&outs[0].sched, time, time, &smf.data[ev->data], ev->size, 0)) {
+			break; // scheduler is full, retry in the next cycle
+		}
+		++smf.pos;
+	}
 }
+
+/**
+ * cleanup and exit
+ * call this function only _after_ everything has been initialized!
+ */
+static void cleanup(int sig) {
+	if (j_client) {
+		jack_client_close (j_client);
+		j_client=NULL;
+	}
+	free_queues();
+	free(smf.events);
+	free(smf.data);
+	fprintf(stderr, "bye.\n");
+}
+
+/* macros, pre-encoded message sequences, fired with a single control
+ * record (CtlMacro, uint16 index, uint16 count) in the first port's queue.
+ *
+ * Each message in a macro's block is stored as
+ *   uint8    output port
+ *   uint32   offset in frames from the time the macro is fired
+ *   varint   size
+ *   uint8    data[size]
+ * The table is double-buffered like the thru rules, the control thread
+ * modifies a copy and switches `macros_active`.
+ */
+#define MAX_MACROS (64)
+#define MACRO_NAME (32)
+#define MACRO_BYTES (65536)
+
+typedef struct {
+	char name[MACRO_NAME];
+	uint32_t offset; // in data
+	uint32_t len;    // bytes
+	uint32_t count;  // messages
+} macro_t;
+
+typedef struct {
+	uint32_t n_macros;
+	uint32_t used;
+	macro_t macro[MAX_MACROS];
+	uint8_t data[MACRO_BYTES];
+} macro_table_t;
+
+static macro_table_t macro_tables[2];
+static int macros_active = 0; // written by the control thread
+static int macros_in_use = 0; // written by process
+
+/* `count` messages were accounted for when the macro was fired,
+ * `stamp` is the earliest time the macro could be fired */
+static void macro_expand(uint32_t index, uint32_t count, jack_nframes_t time, jack_nframes_t stamp, uint8_t owner) {
+	const macro_table_t *t = &macro_tables[macros_in_use];
+	const uint8_t *p, *end;
+
+	if (index >= t->n_macros) {
+		__atomic_store_n(&stats.port_dropped, stats.port_dropped + count, __ATOMIC_RELAXED);
+		owner_done(owner, count, 0, 0);
+		return;
+	}
+	p = &t->data[t->macro[index].offset];
+	end = p + t->macro[index].len;
+
+	for (; count > 0 && p < end; --count) {
+		const uint8_t port = p[0];
+		jack_nframes_t offset;
+		uint32_t size;
+		memcpy(&offset, &p[1], sizeof(uint32_t));
+		p += 1 + sizeof(uint32_t);
+		p += varint_read(p, &size);
+		if (port >= n_outs || sched_push(&outs[port].sched, time + offset, stamp + offset, p, size, owner)) {
+			__atomic_store_n(&stats.port_dropped, stats.port_dropped + 1, __ATOMIC_RELAXED);
+			owner_done(owner, 1, 0, 0);
+		}
+		p += size;
+	}
+	if (count > 0) {
+		/* the macro was redefined in the meantime */
+		__atomic_store_n(&stats.port_dropped, stats.port_dropped + count, __ATOMIC_RELAXED);
+		owner_done(owner, count, 0, 0);
+	}
+}
+
+/* clock and pattern generator, owned by the process callback.
+ *
+ * MIDI clock (24 per quarter note) is computed from a 64 bit frame
+ * counter: tick n is due at origin + n * frames_per_tick, so rounding
+ * never accumulates. A tempo change moves the origin to the next tick.
+ * Patterns fire a sequence of macros, one step every `ticks` clocks,
+ * aligned to the song position. The generator is controlled with
+ * CtlClock and CtlPattern records, at the time of the record.
+ */
+#define MAX_PATTERNS (8)
+#define PATTERN_STEPS (16)
+#define NO_MACRO (0xffff)
+#define CLOCK_BPM (120) // default tempo, as for SMF without a tempo map
+
+enum {
+	ClockStart,
+	ClockStop,
+	ClockContinue,
+	ClockTempo,
+	ClockLocate
+};
+
+typedef struct {
+	uint16_t ticks;   // clocks per step
+	uint8_t n_steps;  // 0: off
+	uint16_t step[PATTERN_STEPS]; // macro index, or NO_MACRO
+} pattern_t;
+
+static struct {
+	int running;
+	uint32_t port;
+	double frames_per_tick; // CLOCK_BPM, set by init_jack()
+	uint64_t origin;   // frame of tick 0
+	uint64_t n;        // ticks since origin
+	uint64_t pos;      // song position, in clocks
+	uint64_t stop_at;  // scheduled stop
+	uint64_t tempo_at; // scheduled tempo change
+	double tempo_fpt;
+	pattern_t pattern[MAX_PATTERNS];
+} gen = { .stop_at = UINT64_MAX, .tempo_at = UINT64_MAX };
+
+/* 24 clocks per quarter note */
+static double clock_frames_per_tick(double bpm) {
+	return jack_get_sample_rate(j_client) * 60.0 / (bpm * 24.0);
+}
+
+/* 64 bit frame-time of the current cycle */
+static uint64_t rt_frame64 = 0;
+static jack_nframes_t rt_cycle_start = 0;
+
+static inline uint64_t frame64(jack_nframes_t time) {
+	return rt_frame64 + (int32_t)(time - rt_cycle_start);
+}
+
+static void gen_push(jack_nframes_t time, const jack_midi_data_t *data, uint32_t size) {
+	__atomic_store_n(&stats.generated, stats.generated + 1, __ATOMIC_RELAXED);
+	if (sched_push(&outs[gen.port].sched, time, time, data, size, 0)) {
+		__atomic_store_n(&stats.port_dropped, stats.port_dropped + 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void gen_clock(const uint8_t *data, uint32_t size, jack_nframes_t time) {
+	const uint64_t t = frame64(time);
+	jack_midi_data_t msg[3];
+
+	if (size < 3 || data[2] >= n_outs) {
+		return;
+	}
+	switch (data[1]) {
+		case ClockStart:
+		case ClockContinue:
+			gen.port = data[2];
+			msg[0] = data[1] == ClockStart ? 0xfa : 0xfb;
+			gen_push(time, msg, 1);
+			if (data[1] == ClockStart) {
+				gen.pos = 0;
+			}
+			gen.origin = t;
+			gen.n = 0;
+			gen.stop_at = UINT64_MAX;
+			__atomic_store_n(&gen.running, 1, __ATOMIC_RELAXED);
+			break;
+		case ClockStop:
+			if (gen.running) {
+				msg[0] = 0xfc;
+				gen_push(time, msg, 1);
+				gen.stop_at = t;
+			}
+			break;
+		case ClockTempo:
+			if (size < 3 + sizeof(double)) {
+				return;
+			}
+			if (gen.running) {
+				memcpy(&gen.tempo_fpt, &data[3], sizeof(double));
+				gen.tempo_at = t;
+			} else {
+				memcpy(&gen.frames_per_tick, &data[3], sizeof(double));
+			}
+			break;
+		case ClockLocate:
+			if (size < 5) {
+				return;
+			}
+			/* song position pointer, in 16th notes */
+			gen.pos = (data[3] | (data[4] << 7)) * 6;
+			msg[0] = 0xf2;
+			msg[1] = data[3];
+			msg[2] = data[4];
+			gen_push(time, msg, 3);
+			if (gen.running) {
+				gen.origin = t;
+				gen.n = 0;
+			}
+			break;
+	}
+}
+
+static void gen_pattern(const uint8_t *data, uint32_t size) {
+	pattern_t *p;
+	uint32_t i;
+	if (size < 5 || data[1] >= MAX_PATTERNS || data[4] > PATTERN_STEPS || size < 5u + 2 * data[4]) {
+		return;
+	}
+	p = &gen.pattern[data[1]];
+	p->ticks = data[2] | (data[3] << 8);
+	p->n_steps = data[4];
+	for (i = 0; i < p->n_steps; ++i) {
+		p->step[i] = data[5 + 2 * i] | (data[6 + 2 * i] << 8);
+	}
+}
+
+/**
+ * emit clocks and pattern steps that are due in this cycle
+ */
+static void gen_process(jack_nframes_t cycle_start, jack_nframes_t nframes) {
+	const uint64_t end = rt_frame64 + nframes;
+	const jack_midi_data_t clock = 0xf8;
+
+	while (gen.running) {
+		uint64_t next = gen.origin + llrint(gen.n * gen.frames_per_tick);
+		jack_nframes_t time;
+		uint32_t i;
+
+		if (next >= gen.tempo_at) {
+			gen.origin = next;
+			gen.n = 0;
+			gen.frames_per_tick = gen.tempo_fpt;
+			gen.tempo_at = UINT64_MAX;
+		}
+		if (next >= gen.stop_at) {
+			__atomic_store_n(&gen.running, 0, __ATOMIC_RELAXED);
+			break;
+		}
+		if (next >= end) {
+			break;
+		}
+
+		time = cycle_start + (jack_nframes_t)(next - rt_frame64);
+		gen_push(time, &clock, 1);
+
+		for (i = 0; i < MAX_PATTERNS; ++i) {
+			const pattern_t *p = &gen.pattern[i];
+			const macro_table_t *t = &macro_tables[macros_in_use];
+			uint16_t m;
+			if (p->n_steps == 0 || gen.pos % p->ticks) {
+				continue;
+			}
+			m = p->step[(gen.pos / p->ticks) % p->n_steps];
+			if (m != NO_MACRO && m < t->n_macros) {
+				__atomic_store_n(&stats.generated, stats.generated + t->macro[m].count, __ATOMIC_RELAXED);
+				macro_expand(m, t->macro[m].count, time, time, 0);
+			}
+		}
+		++gen.n;
+		++gen.pos;
+	}
+}
+
+/* process a control record */
+static void control_record(const uint8_t *data, uint32_t size, jack_nframes_t time, jack_nframes_t stamp, uint8_t owner) {
+	switch (data[0]) {
+		case CtlMacro:
+			if (size == 5) {
+				macro_expand(data[1] | (data[2] << 8), data[3] | (data[4] << 8), time, stamp, owner);
+			}
+			break;
+		case CtlClock:
+			gen_clock(data, size, time);
+			break;
+		case CtlPattern:
+			gen_pattern(data, size);
+			break;
+	}
+}
+
+/* the next record of a queue, see queue_drain() */
+typedef struct {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t hdr;
+	uint32_t len;    // 0: not parsed yet
+	jack_nframes_t time;
+	jack_nframes_t stamp;
+	uint8_t owner;
+	const uint8_t *data;
+} queue_front_t;
+
+/* returns 0 if the queue is empty */
+static inline int queue_front(const event_queue_t *q, queue_front_t *f, jack_nframes_t cycle_start) {
+	uint32_t pos, len;
+	if (f->len > 0) {
+		return 1;
+	}
+	if (f->tail == f->head) {
+		return 0;
+	}
+	pos = f->tail & q->mask;
+	if (q->buf[pos] == 0) {
+		f->tail += q->size - pos; // padding
+		if (f->tail == f->head) {
+			return 0;
+		}
+		pos = 0;
+	}
+	len = varint_read(&q->buf[pos], &f->hdr);
+	f->time = cycle_start;
+	if (f->hdr & EV_SCHEDULED) {
+		memcpy(&f->time, &q->buf[pos + len], sizeof(jack_nframes_t));
+		len += sizeof(jack_nframes_t);
+	}
+	f->stamp = f->time;
+	if (f->hdr & EV_STAMPED) {
+		memcpy(&f->stamp, &q->buf[pos + len], sizeof(jack_nframes_t));
+		len += sizeof(jack_nframes_t);
+	}
+	f->owner = 0;
+	if (f->hdr & EV_OWNED) {
+		f->owner = q->buf[pos + len++];
+	}
+	f->data = &q->buf[pos + len];
+	f->len = len + (f->hdr >> EV_FLAGBITS);
+	return 1;
+}
+
+/**
+ * move queued events to the scheduler,
+ * events that remain in the queue when it's full provide backpressure.
+ * With more than one producer the queues are merged by the time the
+ * events were queued, so events due at the same time keep that order.
+ */
+static int queue_drain(midi_out_t *o, jack_nframes_t cycle_start) {
+	queue_front_t front[MAX_SOURCES];
+	int s, moved = 0;
+
+	for (s = 0; s < MAX_SOURCES; ++s) {
+		front[s].head = __atomic_load_n(&o->queue[s].head, __ATOMIC_ACQUIRE);
+		front[s].tail = o->queue[s].tail;
+		front[s].len = 0;
+	}
+
+	for (;;) {
+		queue_front_t *f = NULL;
+		jack_nframes_t stamp;
+		for (s = 0; s < MAX_SOURCES; ++s) {
+			if (queue_front(&o->queue[s], &front[s], cycle_start)
+					&& (!f || (int32_t)(front[s].stamp - f->stamp) < 0)) {
+				f = &front[s];
+			}
+		}
+		if (!f) {
+			break;
+		}
+		/* latency is measured from the due time, if it was queued earlier */
+		stamp = f->stamp;
+		if ((f->hdr & EV_SCHEDULED) && (int32_t)(f->time - stamp) > 0) {
+			stamp = f->time;
+		}
+		if (f->hdr & EV_CONTROL) {
+			control_record(f->data, f->hdr >> EV_FLAGBITS, f->time, stamp, f->owner);
+		} else if (sched_push(&o->sched, f->time, stamp, f->data, f->hdr >> EV_FLAGBITS, f->owner)) {
+			break;
+		}
+		f->tail += f->len;
+		f->len = 0;
+	}
+
+	for (s = 0; s < MAX_SOURCES; ++s) {
+		if (front[s].tail != o->queue[s].tail) {
+			__atomic_store_n(&o->queue[s].tail, front[s].tail, __ATOMIC_RELEASE);
+			moved = 1;
+		}
+	}
+	return moved;
+}
+
+/* MIDI thru, input events are forwarded to an output port in the same cycle
+ * after passing the rule table.
+ *
+ * Rules are applied in order, each one that matches transforms the message,
+ * a drop rule ends processing. The control thread edits a copy of the table
+ * and publishes it by switching `active`. The process callback acknowledges
+ * the table it uses with `in_use`, the previous one is not modified before
+ * that, see rules_edit().
+ */
+#define MAX_RULES (64)
+#define THRU_MAX (512) // max. events per cycle
+
+enum {
+	RuleDrop,
+	RuleChannel,
+	RuleTranspose,
+	RuleScale
+};
+
+typedef struct {
+	uint8_t action;
+	uint8_t type;      // message type (status & 0xf0), 0: any channel message
+	uint16_t channels; // bitmask of matching channels
+	uint8_t lo, hi;    // range of the first data byte
+	int16_t arg;       // channel, semitones or percent
+} rule_t;
+
+typedef struct {
+	uint32_t port; // output port + 1, 0: thru is off
+	uint32_t n_rules;
+	rule_t rule[MAX_RULES];
+} rule_table_t;
+
+static rule_table_t rule_tables[2];
+static int rules_active = 0; // written by the control thread
+static int rules_in_use = 0; // written by process
+
+/* input events to forward in this cycle, owned by process */
+typedef struct {
+	jack_nframes_t time; // offset in the cycle
+	uint32_t size;
+	const jack_midi_data_t *data; // the input buffer, or msg
+	jack_midi_data_t msg[3];
+} thru_event_t;
+
+static thru_event_t thru_buf[THRU_MAX];
+
+static inline int rule_match(const rule_t *r, const jack_midi_data_t *msg, uint32_t size) {
+	const uint8_t type = msg[0] & 0xf0;
+	if (r->type == 0xf0) {
+		return msg[0] >= 0xf0;
+	}
+	if (msg[0] >= 0xf0 || !(r->channels & (1 << (msg[0] & 0x0f)))) {
+		return 0;
+	}
+	if (r->type != 0 && r->type != type && !(r->type == 0x90 && type == 0x80)) {
+		return 0;
+	}
+	if (r->lo > 0 || r->hi < 0x7f) {
+		return size > 1 && msg[1] >= r->lo && msg[1] <= r->hi;
+	}
+	return 1;
+}
+
+/* returns -1 if the message is dropped */
+static int rules_apply(const rule_table_t *t, jack_midi_data_t *msg, uint32_t size) {
+	uint32_t i;
+	for (i = 0; i < t->n_rules; ++i) {
+		const rule_t *r = &t->rule[i];
+		int v;
+		if (!rule_match(r, msg, size)) {
+			continue;
+		}
+		switch (r->action) {
+			case RuleDrop:
+				return -1;
+			case RuleChannel:
+				if (msg[0] < 0xf0) {
+					msg[0] = (msg[0] & 0xf0) | r->arg;
+				}
+				break;
+			case RuleTranspose:
+				if ((msg[0] & 0xf0) <= 0xa0 && size == 3) {
+					v = msg[1] + r->arg;
+					if (v < 0 || v > 0x7f) {
+						return -1;
+					}
+					msg[1] = v;
+				}
+				break;
+			case RuleScale:
+				if ((msg[0] & 0xf0) == 0xe0 && size == 3) {
+					/* 14 bit, around the center */
+					v = (((msg[1] | (msg[2] << 7)) - 0x2000) * r->arg) / 100 + 0x2000;
+					v = v < 0 ? 0 : v > 0x3fff ? 0x3fff : v;
+					msg[1] = v & 0x7f;
+					msg[2] = v >> 7;
+				} else if (msg[0] < 0xf0 && size > 1) {
+					const uint32_t d = size - 1;
+					v = (msg[d] * r->arg) / 100;
+					v = v > 0x7f ? 0x7f : v;
+					if ((msg[0] & 0xf0) == 0x90 && msg[d] > 0 && v == 0) {
+						v = 1; // don't turn note-on into note-off
+					}
+					msg[d] = v;
+				}
+				break;
+		}
+	}
+	return 0;
+}
+
+/**
+ * pass events from the input port to the control thread,
+ * and collect the ones to forward in thru_buf
+ */
+static int input_receive(jack_nframes_t cycle_start, jack_nframes_t nframes, const rule_table_t *rules, uint32_t *n_thru) {
+	void *in = jack_port_get_buffer(midi_in.port, nframes);
+	const uint32_t n = jack_midi_get_event_count(in);
+	event_queue_t *q = &midi_in.queue;
+	uint32_t i;
+
+	*n_thru = 0;
+	for (i = 0; i < n; ++i) {
+		jack_midi_event_t ev;
+		uint32_t hdr;
+		int64_t pad;
+		if (jack_midi_event_get(&ev, in, i)) {
+			continue;
+		}
+		if (rules->port > 0 && *n_thru < THRU_MAX) {
+			thru_event_t *te = &thru_buf[*n_thru];
+			te->time = ev.time;
+			te->size = ev.size;
+			if (ev.size <= sizeof(te->msg)) {
+				memcpy(te->msg, ev.buffer, ev.size);
+				te->data = te->msg;
+			} else {
+				/* sysex is forwarded unmodified, only the status is matched */
+				te->msg[0] = ev.buffer[0];
+				te->data = ev.buffer;
+			}
+			if (ev.size > 0 && rules_apply(rules, te->msg, te->data == te->msg ? ev.size : 1) == 0) {
+				++*n_thru;
+			}
+		} else if (rules->port > 0) {
+			__atomic_store_n(&stats.thru_dropped, stats.thru_dropped + 1, __ATOMIC_RELAXED);
+		}
+		hdr = (ev.size << EV_FLAGBITS) | EV_SCHEDULED;
+		if (ev.size > (size_t)max_sysex
+				|| (pad = queue_space(q, varint_len(hdr) + sizeof(jack_nframes_t) + ev.size)) < 0) {
+			/* without a 'wait' nobody reads it, only count what may be missed */
+			if (__atomic_load_n(&midi_in.waiting, __ATOMIC_RELAXED)) {
+				__atomic_store_n(&stats.in_dropped, stats.in_dropped + 1, __ATOMIC_RELAXED);
+			}
+			continue;
+		}
+		queue_put(q, pad, hdr, cycle_start + ev.time, 0, ev.buffer, ev.size);
+		__atomic_store_n(&stats.received, stats.received + 1, __ATOMIC_RELAXED);
+	}
+	if (n == 0) {
+		return 0;
+	}
+	__atomic_store_n(&q->head, q->write, __ATOMIC_RELEASE);
+	return __atomic_load_n(&midi_in.waiting, __ATOMIC_RELAXED);
+}
+
+/* capture of all events written to the output ports, see --record.
+ *
+ * The process callback copies each event into an SPSC queue with the
+ * same record format as the event queues, the data is prefixed with
+ * the port index, the time is absolute. A writer thread empties it into
+ * a 'timed' binary file that can be replayed with --replay:
+ *   VLQ delta-time in frames, MIDI message (with running status)
+ * A change of the output port is written as system common message
+ * 'F5 <port>' (port select), which is also used to bridge delta-times
+ * that don't fit into 4 bytes. The first delta-time is zero.
+ *
+ * Ports are processed one after another, the writer sorts the events
+ * of each cycle by time. The queue is published once per cycle, so it
+ * only ever contains complete cycles, and each pass drains all of it up
+ * to the published head: a cycle is never split across two flushes.
+ * Every record takes at least 7 bytes (messages are never empty), so
+ * the queue can't hold more than CAPTURE_MAX records.
+ */
+#define CAPTURE_QUEUE (1 << 20)
+#define CAPTURE_MAX (CAPTURE_QUEUE / 7) // smallest record: 1 + 4 + port + 1
+#define VLQ_MAX (0x0fffffff)
+
+typedef struct {
+	jack_nframes_t time;
+	uint32_t seq;
+	uint32_t size;
+	const uint8_t *rec;
+} capture_ref_t;
+
+static struct {
+	event_queue_t queue;
+	const char *path;
+	FILE *f;
+	pthread_t thread;
+	int running;
+	uint32_t dropped;    // process: capture queue was full
+	/* writer thread */
+	capture_ref_t *sorted;
+	jack_nframes_t last; // time of the previous event
+	int started;
+	uint8_t port;
+	uint8_t status;      // running status
+} capture;
+
+/* process: copy an event that was written to port `port` */
+static void capture_event(uint32_t port, jack_nframes_t time, const jack_midi_data_t *data, uint32_t size) {
+	event_queue_t *q = &capture.queue;
+	const uint32_t hdr = ((size + 1) << EV_FLAGBITS) | EV_SCHEDULED;
+	const int64_t pad = queue_space(q, varint_len(hdr) + sizeof(jack_nframes_t) + 1 + size);
+	uint8_t *rec;
+	if (pad < 0) {
+		__atomic_store_n(&capture.dropped, capture.dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	/* like queue_put(), with the port byte */
+	rec = queue_put_header(q, pad, hdr, time, 0);
+	rec[0] = port;
+	memcpy(&rec[1], data, size);
+	q->write += 1 + size;
+}
+
+static void capture_vlq(uint32_t v) {
+	uint8_t buf[4];
+	int n = 0;
+	buf[3] = v & 0x7f;
+	while ((v >>= 7) > 0 && n < 3) {
+		buf[2 - n++] = (v & 0x7f) | 0x80;
+	}
+	fwrite(&buf[3 - n], 1, n + 1, capture.f);
+}
+
+static void capture_port(uint32_t delta, uint8_t port) {
+	const uint8_t msg[2] = { 0xf5, port };
+	capture_vlq(delta);
+	fwrite(msg, 1, 2, capture.f);
+	capture.port = port;
+	capture.status = 0;
+}
+
+static void capture_write(const uint8_t *rec, uint32_t size, jack_nframes_t time) {
+	const uint8_t port = rec[0];
+	const uint8_t *data = &rec[1];
+	uint32_t delta = capture.started ? time - capture.last : 0;
+
+	capture.started = 1;
+	capture.last = time;
+	--size;
+	while (delta > VLQ_MAX) {
+		capture_port(VLQ_MAX, capture.port);
+		delta -= VLQ_MAX;
+	}
+	if (port != capture.port) {
+		capture_port(delta, port);
+		delta = 0;
+	}
+	capture_vlq(delta);
+	if (data[0] == capture.status && data[0] < 0xf0) {
+		fwrite(&data[1], 1, size - 1, capture.f);
+	} else {
+		fwrite(data, 1, size, capture.f);
+	}
+	if (data[0] < 0xf0) {
+		capture.status = data[0];
+	} else if (data[0] < 0xf8) {
+		capture.status = 0;
+	}
+}
+
+static int capture_cmp(const void *a, const void *b) {
+	const capture_ref_t *ca = a;
+	const capture_ref_t *cb = b;
+	const int32_t d = (int32_t)(ca->time - cb->time);
+	if (d != 0) {
+		return d < 0 ? -1 : 1;
+	}
+	return ca->seq < cb->seq ? -1 : 1;
+}
+
+static void capture_flush(void) {
+	event_queue_t *q = &capture.queue;
+	const uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	uint32_t tail = q->tail;
+	uint32_t n = 0;
+	uint32_t i;
+
+	/* the records stay in the queue until they are written */
+	while (tail != head) {
+		const uint32_t pos = tail & q->mask;
+		capture_ref_t *c = &capture.sorted[n];
+		uint32_t hdr, len;
+		if (q->buf[pos] == 0) {
+			tail += q->size - pos; // padding
+			continue;
+		}
+		len = varint_read(&q->buf[pos], &hdr);
+		memcpy(&c->time, &q->buf[pos + len], sizeof(jack_nframes_t));
+		len += sizeof(jack_nframes_t);
+		c->seq = n++;
+		c->size = hdr >> EV_FLAGBITS;
+		c->rec = &q->buf[pos + len];
+		tail += len + c->size;
+	}
+	qsort(capture.sorted, n, sizeof(capture_ref_t), capture_cmp);
+	for (i = 0; i < n; ++i) {
+		capture_write(capture.sorted[i].rec, capture.sorted[i].size, capture.sorted[i].time);
+	}
+	__atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void *capture_thread(void *arg) {
+	while (__atomic_load_n(&capture.running, __ATOMIC_ACQUIRE)) {
+		const struct timespec ts = { 0, 10000000 };
+		capture_flush();
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+static int capture_start(void) {
+	if (!(capture.f = fopen(capture.path, "wb"))) {
+		fprintf(stderr, "cannot open '%s': %s\n", capture.path, strerror(errno));
+		return -1;
+	}
+	if (!(capture.queue.buf = alloc_locked(CAPTURE_QUEUE)) || !(capture.sorted = malloc(CAPTURE_MAX * sizeof(capture_ref_t)))) {
+		fprintf(stderr, "cannot allocate capture queue.\n");
+		return -1;
+	}
+	capture.queue.size = CAPTURE_QUEUE;
+	capture.queue.mask = CAPTURE_QUEUE - 1;
+	capture.running = 1;
+	if (pthread_create(&capture.thread, NULL, capture_thread, NULL)) {
+		fprintf(stderr, "cannot start capture thread.\n");
+		capture.running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static void capture_stop(void) {
+	if (__atomic_load_n(&capture.running, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&capture.running, 0, __ATOMIC_RELEASE);
+		pthread_join(capture.thread, NULL);
+	}
+	if (capture.f) {
+		if (capture.queue.buf) {
+			capture_flush();
+		}
+		fclose(capture.f);
+		capture.f = NULL;
+	}
+	free(capture.queue.buf);
+	free(capture.sorted);
+	capture.queue.buf = NULL;
+	capture.sorted = NULL;
+	if (capture.dropped) {
+		fprintf(stderr, "Warning: %u events were not recorded.\n", capture.dropped);
+	}
+}
+
+/* optional coalescing of control changes and pitch-bend, owned by process.
+ *
+ * The events that are due in a cycle are staged, and a message is
+ * dropped if a later one in the same cycle sets the same controller
+ * (or pitch-bend) of the same channel. Any other channel message on
+ * that channel is a barrier, so is a system common message for all
+ * channels: "CC 1 10; N 60 100; CC 1 20" is sent unchanged.
+ * Data entry, (N)RPN selection and channel mode messages depend on
+ * order and are never coalesced. Thru events are not staged.
+ */
+#define COALESCE_MAX (256)           // staged events per port and cycle
+#define COALESCE_KEYS (16 * 129)     // channel * (128 controllers + pitch-bend)
+
+static int coalesce = 0;
+static sched_event_t staged[COALESCE_MAX]; // size 0: superseded
+static uint64_t coalesce_seen[COALESCE_KEYS];
+static uint64_t coalesce_epoch = 0;
+
+static inline int coalesce_key(const jack_midi_data_t *d, uint32_t size) {
+	if (size != 3) {
+		return -1;
+	}
+	switch (d[0] & 0xf0) {
+		case 0xb0:
+			if (d[1] == 6 || d[1] == 38 || (d[1] >= 96 && d[1] <= 101) || d[1] >= 120) {
+				return -1;
+			}
+			return (d[0] & 0x0f) * 129 + d[1];
+		case 0xe0:
+			return (d[0] & 0x0f) * 129 + 128;
+	}
+	return -1;
+}
+
+/* move due events to `staged`, and mark the superseded ones */
+static uint32_t coalesce_stage(sched_t *s, jack_nframes_t cycle_start, jack_nframes_t nframes) {
+	uint64_t epoch[16];
+	uint32_t n = 0;
+	uint32_t i, c;
+
+	while (s->len > 0 && n < COALESCE_MAX) {
+		const sched_event_t *ev = &s->heap[0];
+		if ((int32_t)(ev->time - cycle_start) >= (int32_t)nframes || ev->size > SCHED_INLINE) {
+			break;
+		}
+		staged[n++] = *ev;
+		sched_pop(s);
+	}
+
+	/* walk backwards, a key is seen if it was set later in this epoch */
+	for (c = 0; c < 16; ++c) {
+		epoch[c] = ++coalesce_epoch;
+	}
+	for (i = n; i-- > 0;) {
+		sched_event_t *ev = &staged[i];
+		const uint8_t status = ev->data[0];
+		const int key = coalesce_key(ev->data, ev->size);
+		if (key >= 0) {
+			if (coalesce_seen[key] == epoch[status & 0x0f]) {
+				ev->size = 0;
+				__atomic_store_n(&stats.coalesced, stats.coalesced + 1, __ATOMIC_RELAXED);
+				owner_done(ev->owner, 1, 0, 0);
+			} else {
+				coalesce_seen[key] = epoch[status & 0x0f];
+			}
+		} else if (status < 0xf0) {
+			epoch[status & 0x0f] = ++coalesce_epoch;
+		} else if (status < 0xf8) {
+			for (c = 0; c < 16; ++c) {
+				epoch[c] = ++coalesce_epoch;
+			}
+		}
+	}
+	return n;
+}
+
+/* byte-rate limit per output port, 0: off.
+ * Each byte written keeps the link busy for `frames_per_byte`,
+ * events are delayed until it's idle, and deferred to the next
+ * cycle if that is after the end of this one. */
+static uint32_t byte_rate = 0;
+static double frames_per_byte = 0;
+
+/* max. events and bytes written per output port and cycle, 0: unlimited.
+ * The remaining due events stay in the scheduler for the next cycle,
+ * so a large burst is spread out instead of causing an xrun. A single
+ * event larger than the byte budget is sent on its own. */
+static uint32_t budget_events = 0;
+static uint32_t budget_bytes = 0;
+
+/**
+ * write an event to the port buffer, and count the bytes it takes
+ * on a DIN link: realtime messages leave running status unchanged,
+ * system common messages cancel it.
+ * The scheduler keeps each message contiguous (inline, or a pool
+ * block), it is copied with a single memcpy into the reserved space.
+ */
+static int port_write(midi_out_t *o, void *out, jack_nframes_t offset, const jack_midi_data_t *data, uint32_t size) {
+	jack_midi_data_t *buf = jack_midi_event_reserve(out, offset, size);
+	if (!buf) {
+		return -1;
+	}
+	memcpy(buf, data, size);
+	if (capture.f) {
+		capture_event(o - outs, rt_cycle_start + offset, data, size);
+	}
+	if (data[0] >= 0xf8) {
+		;
+	} else if (data[0] >= 0xf0) {
+		o->running_status = 0;
+	} else if (data[0] == o->running_status) {
+		--size;
+	} else {
+		o->running_status = data[0];
+	}
+	__atomic_store_n(&stats.wire_bytes, stats.wire_bytes + size, __ATOMIC_RELAXED);
+	if (frames_per_byte > 0) {
+		const double now = (double)(rt_frame64 + offset);
+		o->link_free = (o->link_free > now ? o->link_free : now) + size * frames_per_byte;
+	}
+	return 0;
+}
+
+/**
+ * send all events that are due in this cycle,
+ * merged with the `n_thru` input events from thru_buf
+ */
+static int port_send(midi_out_t *o, jack_nframes_t cycle_start, jack_nframes_t nframes, uint32_t n_thru) {
+	void *out = jack_port_get_buffer(o->port, nframes);
+	sched_t *s = &o->sched;
+	jack_nframes_t offset = 0;
+	const uint32_t n_staged = coalesce ? coalesce_stage(s, cycle_start, nframes) : 0;
+	uint32_t k = 0;
+	uint32_t t = 0;
+	uint32_t n_sent = 0, n_late = 0; // published once per cycle
+	uint32_t n_bytes = 0;
+	int limited = 0;
+	int progress = n_staged > 0;
+
+	jack_midi_clear_buffer(out);
+
+	while (1) {
+		const sched_event_t *ev;
+		while (k < n_staged && staged[k].size == 0) {
+			++k;
+		}
+		ev = limited ? NULL : k < n_staged ? &staged[k] : s->len > 0 ? &s->heap[0] : NULL;
+		/* wrap-around safe distance to the start of this cycle */
+		const int32_t when = ev ? (int32_t)(ev->time - cycle_start) : 0;
+		if (ev && when >= (int32_t)nframes) {
+			ev = NULL; // not yet due
+		}
+
+		if (t < n_thru && (!ev || thru_buf[t].time < (when > (int32_t)offset ? (jack_nframes_t)when : offset))) {
+			const thru_event_t *te = &thru_buf[t++];
+			if (te->time > offset) {
+				offset = te->time;
+			}
+			if (port_write(o, out, offset, te->data, te->size)) {
+				__atomic_store_n(&stats.thru_dropped, stats.thru_dropped + 1, __ATOMIC_RELAXED);
+			} else {
+				__atomic_store_n(&stats.thru, stats.thru + 1, __ATOMIC_RELAXED);
+			}
+			continue;
+		}
+		if (!ev) {
+			break;
+		}
+
+		/* late events are sent immediately,
+		 * jack needs events in chronological order */
+		if (when > (int32_t)offset) {
+			offset = when;
+		}
+		if ((budget_events > 0 && n_sent >= budget_events)
+				|| (budget_bytes > 0 && n_sent > 0 && n_bytes + ev->size > budget_bytes)) {
+			__atomic_store_n(&stats.budget_limited, stats.budget_limited + 1, __ATOMIC_RELAXED);
+			limited = 1;
+			continue;
+		}
+		if (frames_per_byte > 0 && o->link_free > (double)(rt_frame64 + offset)) {
+			/* thru events are not delayed, but use the link, too */
+			const double busy = ceil(o->link_free - (double)rt_frame64);
+			if (busy >= nframes) {
+				__atomic_store_n(&stats.rate_limited, stats.rate_limited + 1, __ATOMIC_RELAXED);
+				limited = 1;
+				continue;
+			}
+			offset = busy;
+		}
+		if (port_write(o, out, offset, k < n_staged ? ev->data : sched_data(s, ev), ev->size)) {
+			if (jack_midi_get_event_count(out) > 0) {
+				/* port buffer is full, retry in the next cycle */
+				__atomic_store_n(&stats.port_deferred, stats.port_deferred + 1, __ATOMIC_RELAXED);
+				break;
+			}
+			/* it will never fit */
+			__atomic_store_n(&stats.port_dropped, stats.port_dropped + 1, __ATOMIC_RELAXED);
+			owner_done(ev->owner, 1, 0, 0);
+		} else {
+			n_late += when < 0;
+			n_bytes += ev->size;
+			++n_sent;
+			owner_done(ev->owner, 1, 1, cycle_start + offset);
+			lat_record((int32_t)(cycle_start + offset - ev->stamp));
+		}
+		if (k < n_staged) {
+			++k;
+		} else {
+			sched_pop(s);
+		}
+		progress = 1;
+	}
+	if (n_sent > 0) {
+		__atomic_store_n(&stats.late, stats.late + n_late, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats.sent, stats.sent + n_sent, __ATOMIC_RELAXED);
+	}
+	/* deferred, back to the scheduler, ahead of the later events due
+	 * at the same time that were not staged */
+	for (; k < n_staged; ++k) {
+		const sched_event_t *ev = &staged[k];
+		if (ev->size > 0 && sched_insert(s, ev->time, ev->stamp, ev->seq, ev->data, ev->size, ev->owner)) {
+			__atomic_store_n(&stats.port_dropped, stats.port_dropped + 1, __ATOMIC_RELAXED);
+			owner_done(ev->owner, 1, 0, 0);
+		}
+	}
+	if (t < n_thru) {
+		__atomic_store_n(&stats.thru_dropped, stats.thru_dropped + n_thru - t, __ATOMIC_RELAXED);
+	}
+	return progress;
+}
+
+/**
+ * jack audio process callback
+ */
+int process (jack_nframes_t nframes, void *arg) {
+	const jack_nframes_t cycle_start = jack_last_frame_time(j_client);
+	const rule_table_t *rules = NULL;
+	const uint32_t sent = stats.sent;
+	uint32_t n_thru = 0;
+	int progress = 0;
+	uint32_t i;
+
+	__atomic_store_n(&macros_in_use, __atomic_load_n(&macros_active, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	rt_frame64 += (jack_nframes_t)(cycle_start - rt_cycle_start);
+	rt_cycle_start = cycle_start;
+
+	for (i = 0; i < n_outs; ++i) {
+		progress |= queue_drain(&outs[i], cycle_start);
+	}
+
+	smf_process(cycle_start, nframes);
+	gen_process(cycle_start, nframes);
+
+	if (midi_in.port) {
+		const int active = __atomic_load_n(&rules_active, __ATOMIC_ACQUIRE);
+		rules = &rule_tables[active];
+		__atomic_store_n(&rules_in_use, active, __ATOMIC_RELEASE);
+		progress |= input_receive(cycle_start, nframes, rules, &n_thru);
+	}
+
+	for (i = 0; i < n_outs; ++i) {
+		progress |= port_send(&outs[i], cycle_start, nframes, rules && rules->port == i + 1 ? n_thru : 0);
+	}
+
+	if (capture.f) {
+		__atomic_store_n(&capture.queue.head, capture.queue.write, __ATOMIC_RELEASE);
+	}
+
+	if (stats.sent != sent) {
+		__atomic_store_n(&latency.cycles, latency.cycles + 1, __ATOMIC_RELAXED);
+		if (stats.sent - sent > latency.events_max) {
+			__atomic_store_n(&latency.events_max, stats.sent - sent, __ATOMIC_RELAXED);
+		}
+	}
+
+	if (progress && (overflow_policy == OverflowBlock || batch || __atomic_load_n(&midi_in.waiting, __ATOMIC_RELAXED))
+			&& pthread_mutex_trylock (&queue_lock) == 0) {
+		pthread_cond_broadcast (&queue_drained);
+		pthread_mutex_unlock (&queue_lock);
+	}
+	return 0;
+}
+
+static int jack_xrun(void *arg) {
+	__atomic_fetch_add(&stats.xruns, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void jack_shutdown (void *arg) {
+	fprintf(stderr,"recv. shutdown request from jackd.\n");
+	client_state=Exit;
+	wakeup_main();
+}
+
+/**
+ * open a client connection to the JACK server
+ */
+static int init_jack(const char *client_name) {
+	jack_status_t status;
+	j_client = jack_client_open (client_name, JackNullOption, &status);
+	if (j_client == NULL) {
+		fprintf (stderr, "jack_client_open() failed, status = 0x%2.0x\n", status);
+		if (status & JackServerFailed) {
+			fprintf (stderr, "Unable to connect to JACK server\n");
+		}
+		return (-1);
+	}
+	if (status & JackNameNotUnique) {
+		client_name = jack_get_client_name(j_client);
+		fprintf (stderr, "jack-client name: `%s'\n", client_name);
+	}
+	gen.frames_per_tick = clock_frames_per_tick(CLOCK_BPM);
+	jack_set_process_callback (j_client, process, 0);
+	jack_set_xrun_callback (j_client, jack_xrun, NULL);
+	jack_on_shutdown (j_client, jack_shutdown, NULL);
+	return (0);
+}
+
+static int jack_portsetup(void) {
+	uint32_t i;
+	for (i = 0; i < n_outs; ++i) {
+		char name[16];
+		if (n_outs == 1) {
+			strcpy(name, "out");
+		} else {
+			snprintf(name, sizeof(name), "out_%u", i + 1);
+		}
+		if ((outs[i].port = jack_port_register(j_client, name, JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0)) == 0) {
+			fprintf (stderr, "cannot register midi ouput port !\n");
+			return (-1);
+		}
+	}
+	if (midi_in.enabled && (midi_in.port = jack_port_register(j_client, "in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0)) == 0) {
+		fprintf (stderr, "cannot register midi input port !\n");
+		return (-1);
+	}
+	return (0);
+}
+
+/* ports given on the command-line,
+ * the n-th is connected to the n-th output, any excess ones to the last.
+ * Each is a port name, or an extended regular expression that matches
+ * the whole name of MIDI input ports of other clients.
+ *
+ * The connections are kept: the port registration and graph order
+ * callbacks wake up a worker thread, that connects new matching ports,
+ * e.g. when a USB MIDI interface is plugged in again.
+ */
+static char **connect_list = NULL;
+static int connect_count = 0;
+
+typedef struct {
+	const char *name;
+	jack_port_t *out;
+	regex_t re;
+	int is_re; // `re` is valid
+} connect_t;
+
+static struct {
+	connect_t *conn;
+	const char **inputs; // MIDI input ports, from jack_get_ports()
+	int resolve;         // ports were (un)registered, refresh `inputs`
+	int pipe[2];         // wakes up the worker
+	pthread_t thread;
+	int running;
+} autoconnect = { .pipe = { -1, -1 } };
+
+static pthread_mutex_t connect_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int connect_match(const connect_t *c, const char *port) {
+	jack_port_t *p;
+	if (!strcmp(port, c->name)) {
+		return 1;
+	}
+	if (!c->is_re || regexec(&c->re, port, 0, NULL, 0)) {
+		return 0;
+	}
+	p = jack_port_by_name(j_client, port);
+	return !(p && jack_port_is_mine(j_client, p));
+}
+
+/**
+ * connect all ports that match the command-line, and are not
+ * connected yet. The port list is only queried again after ports
+ * were registered or unregistered, otherwise this does not need
+ * the server unless a connection is missing.
+ */
+static void connect_update(int verbose) {
+	int i, k;
+
+	pthread_mutex_lock(&connect_lock);
+	if (__atomic_exchange_n(&autoconnect.resolve, 0, __ATOMIC_ACQ_REL)) {
+		if (autoconnect.inputs) {
+			jack_free(autoconnect.inputs);
+		}
+		autoconnect.inputs = jack_get_ports(j_client, NULL, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput);
+	}
+	for (i = 0; i < connect_count; ++i) {
+		const connect_t *c = &autoconnect.conn[i];
+		int matched = 0;
+		for (k = 0; autoconnect.inputs && autoconnect.inputs[k]; ++k) {
+			const char *port = autoconnect.inputs[k];
+			int rv;
+			if (!connect_match(c, port)) {
+				continue;
+			}
+			++matched;
+			if (jack_port_connected_to(c->out, port)) {
+				continue;
+			}
+			rv = jack_connect(j_client, jack_port_name(c->out), port);
+			if (rv && rv != EEXIST) {
+				fprintf(stderr, "cannot connect port %s to %s\n", jack_port_name(c->out), port);
+			} else if (!rv && !verbose) {
+				fprintf(stderr, "reconnected port %s to %s\n", jack_port_name(c->out), port);
+			}
+		}
+		if (!matched) {
+			/* not in the list, it may be an alias (e.g. of a2j or ALSA ports) */
+			jack_port_t *p = jack_port_by_name(j_client, c->name);
+			int rv = -1;
+			if (p && jack_port_connected_to(c->out, jack_port_name(p))) {
+				continue;
+			}
+			if (p) {
+				rv = jack_connect(j_client, jack_port_name(c->out), c->name);
+			}
+			if (rv && rv != EEXIST && (p || verbose)) {
+				fprintf(stderr, "cannot connect port %s to %s\n", jack_port_name(c->out), c->name);
+			} else if (!rv && !verbose) {
+				fprintf(stderr, "reconnected port %s to %s\n", jack_port_name(c->out), c->name);
+			}
+		}
+	}
+	pthread_mutex_unlock(&connect_lock);
+}
+
+/* at startup and with the 'reconnect' command */
+static void connect_ports(void) {
+	if (connect_count > 0) {
+		__atomic_store_n(&autoconnect.resolve, 1, __ATOMIC_RELEASE);
+		connect_update(1);
+	}
+}
+
+/* jack notification thread, must not call the server */
+static void connect_wakeup(void) {
+	if (autoconnect.pipe[1] >= 0) {
+		ssize_t rv = write(autoconnect.pipe[1], "", 1);
+		(void) rv;
+	}
+}
+
+static void port_registration(jack_port_id_t id, int reg, void *arg) {
+	__atomic_store_n(&autoconnect.resolve, 1, __ATOMIC_RELEASE);
+	connect_wakeup();
+}
+
+static int graph_order(void *arg) {
+	connect_wakeup();
+	return 0;
+}
+
+static void *connect_thread(void *arg) {
+	char tmp[64];
+	/* a burst of notifications is handled with a single update */
+	while (read(autoconnect.pipe[0], tmp, sizeof(tmp)) > 0
+			&& __atomic_load_n(&autoconnect.running, __ATOMIC_ACQUIRE)) {
+		connect_update(0);
+	}
+	return NULL;
+}
+
+/* before jack_activate() */
+static int connect_init(void) {
+	int i;
+	if (connect_count == 0) {
+		return 0;
+	}
+	if (!(autoconnect.conn = calloc(connect_count, sizeof(connect_t)))) {
+		return -1;
+	}
+	for (i = 0; i < connect_count; ++i) {
+		connect_t *c = &autoconnect.conn[i];
+		char *expr = malloc(strlen(connect_list[i]) + 5);
+		c->name = connect_list[i];
+		c->out = outs[(uint32_t)i < n_outs ? (uint32_t)i : n_outs - 1].port;
+		if (expr) {
+			sprintf(expr, "^(%s)$", connect_list[i]);
+			c->is_re = !regcomp(&c->re, expr, REG_EXTENDED | REG_NOSUB);
+			free(expr);
+		}
+	}
+	if (pipe(autoconnect.pipe)) {
+		fprintf(stderr, "cannot create pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(autoconnect.pipe[1], F_SETFL, O_NONBLOCK);
+	autoconnect.running = 1;
+	if (pthread_create(&autoconnect.thread, NULL, connect_thread, NULL)) {
+		fprintf(stderr, "cannot start connect thread.\n");
+		autoconnect.running = 0;
+		return -1;
+	}
+	jack_set_port_registration_callback(j_client, port_registration, NULL);
+	jack_set_graph_order_callback(j_client, graph_order, NULL);
+	return 0;
+}
+
+static void connect_stop(void) {
+	int i;
+	if (__atomic_load_n(&autoconnect.running, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&autoconnect.running, 0, __ATOMIC_RELEASE);
+		connect_wakeup();
+		pthread_join(autoconnect.thread, NULL);
+	}
+	if (autoconnect.pipe[0] >= 0) {
+		const int fd = autoconnect.pipe[1];
+		autoconnect.pipe[1] = -1;
+		close(fd);
+		close(autoconnect.pipe[0]);
+		autoconnect.pipe[0] = -1;
+	}
+	for (i = 0; autoconnect.conn && i < connect_count; ++i) {
+		if (autoconnect.conn[i].is_re) {
+			regfree(&autoconnect.conn[i].re);
+		}
+	}
+	free(autoconnect.conn);
+	autoconnect.conn = NULL;
+	if (autoconnect.inputs) {
+		jack_free(autoconnect.inputs);
+		autoconnect.inputs = NULL;
+	}
+}
+
+void catchsig (int sig) {
+#ifndef _WIN32
+	signal(SIGHUP, catchsig);
+#endif
+	fprintf(stderr,"caught signal - shutting down.\n");
+	client_state=Exit;
+	wakeup_main();
+}
+
+/* the control loop reads SIGHUP, SIGINT and SIGTERM from a signalfd.
+ * They are blocked before any thread is started, so that none of
+ * them receives the signals instead. */
+static int signal_fd = -1;
+
+#ifdef __linux__
+static int signal_init(void) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (pthread_sigmask(SIG_BLOCK, &mask, NULL)) {
+		return -1;
+	}
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	return signal_fd < 0 ? -1 : 0;
+}
+
+static void signal_read(void) {
+	struct signalfd_siginfo si;
+	while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+		fprintf(stderr,"caught signal - shutting down.\n");
+		client_state=Exit;
+	}
+}
+#endif
+
+/* tell a service manager (systemd Type=notify) about state changes,
+ * see sd_notify(3). Without NOTIFY_SOCKET this does nothing. */
+static void notify_supervisor(const char *state) {
+#ifndef _WIN32
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un sun;
+	socklen_t len;
+	int fd;
+
+	if (!path || (path[0] != '/' && path[0] != '@') || strlen(path) >= sizeof(sun.sun_path)) {
+		return;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if (path[0] == '@') {
+		sun.sun_path[0] = '\0'; // abstract namespace
+	}
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+		return;
+	}
+	if (sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&sun, len) < 0) {
+		fprintf(stderr, "Warning: cannot notify the service manager: %s\n", strerror(errno));
+	}
+	close(fd);
+#endif
+}
+
+/**************************
+ * main application code
+ */
+
+static int queue_size = JACK_MIDI_QUEUE_SIZE;
+static const char *smf_file = NULL;
+
+/* scheduling of the input thread, that parses and queues events */
+static int rt_policy = SCHED_OTHER;
+static int rt_priority = 0;
+#ifdef __linux__
+static cpu_set_t rt_cpus;
+static int rt_cpus_set = 0;
+#endif
+
+/* parse '[fifo:|rr:]<priority>' */
+static int parse_priority(const char *arg) {
+	char *end;
+	long prio;
+	if (!strncmp(arg, "fifo:", 5)) {
+		rt_policy = SCHED_FIFO;
+		arg += 5;
+	} else if (!strncmp(arg, "rr:", 3)) {
+		rt_policy = SCHED_RR;
+		arg += 3;
+	} else {
+		rt_policy = SCHED_FIFO;
+	}
+	prio = strtol(arg, &end, 10);
+	if (end == arg || *end
+			|| prio < sched_get_priority_min(rt_policy)
+			|| prio > sched_get_priority_max(rt_policy)) {
+		return -1;
+	}
+	rt_priority = prio;
+	return 0;
+}
+
+#ifdef __linux__
+/* parse a cpu list, e.g. '1' or '0,2-3' */
+static int parse_cpus(const char *arg) {
+	CPU_ZERO(&rt_cpus);
+	while (*arg) {
+		char *end;
+		long lo = strtol(arg, &end, 10), hi = lo;
+		if (end == arg) {
+			return -1;
+		}
+		if (*end == '-') {
+			arg = end + 1;
+			hi = strtol(arg, &end, 10);
+			if (end == arg) {
+				return -1;
+			}
+		}
+		if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) {
+			return -1;
+		}
+		for (; lo <= hi; ++lo) {
+			CPU_SET(lo, &rt_cpus);
+		}
+		if (*end == ',') {
+			++end;
+		} else if (*end) {
+			return -1;
+		}
+		arg = end;
+	}
+	rt_cpus_set = 1;
+	return CPU_COUNT(&rt_cpus) > 0 ? 0 : -1;
+}
+#endif
+
+/**
+ * apply --priority and --affinity to the calling thread.
+ * Only warns on failure, the events are sent anyway.
+ */
+static void input_thread_setup(void) {
+	int rv;
+	if (rt_policy != SCHED_OTHER) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = rt_priority;
+		if ((rv = pthread_setschedparam(pthread_self(), rt_policy, &param))) {
+			fprintf(stderr, "Warning: cannot set %s priority %d for the input thread: %s.\n"
+					"  Events may be delayed on a busy system, check the 'rtprio' limit (ulimit -r).\n",
+					rt_policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR", rt_priority, strerror(rv));
+		} else if (jack_is_realtime(j_client) && rt_priority >= jack_client_real_time_priority(j_client)) {
+			fprintf(stderr, "Warning: input thread priority %d is not below the one of the JACK process thread (%d).\n",
+					rt_priority, jack_client_real_time_priority(j_client));
+		}
+	}
+#ifdef __linux__
+	if (rt_cpus_set && (rv = pthread_setaffinity_np(pthread_self(), sizeof(rt_cpus), &rt_cpus))) {
+		fprintf(stderr, "Warning: cannot set the CPU affinity of the input thread: %s.\n", strerror(rv));
+	}
+#endif
+}
+
+#define MAX_LISTEN (8)
+static const char *listen_specs[MAX_LISTEN];
+static int n_listen_specs = 0;
+
+static struct option const long_options[] =
+{
+	{"affinity", required_argument, 0, 'a'},
+	{"batch", no_argument, 0, 'b'},
+	{"binary", required_argument, 0, 'B'},
+	{"coalesce", no_argument, 0, 'c'},
+	{"daemon", no_argument, 0, 'd'},
+	{"file", required_argument, 0, 'f'},
+	{"help", no_argument, 0, 'h'},
+	{"input", no_argument, 0, 'i'},
+	{"listen", required_argument, 0, 'l'},
+	{"max-per-cycle", required_argument, 0, 'm'},
+	{"overflow", required_argument, 0, 'O'},
+	{"ports", required_argument, 0, 'p'},
+	{"priority", required_argument, 0, 't'},
+	{"queue-size", required_argument, 0, 'q'},
+	{"rate", required_argument, 0, 'r'},
+	{"record", required_argument, 0, 'R'},
+	{"replay", required_argument, 0, 'P'},
+	{"smf", required_argument, 0, 's'},
+	{"sysex-size", required_argument, 0, 'S'},
+	{"version", no_argument, 0, 'V'},
+	{NULL, 0, NULL, 0}
+};
+
+static void usage (int status) {
+	printf ("jack_midi_command - JACK app to generate custom MIDI messages.\n\n");
+	printf ("Usage: jack_midi_command [ OPTIONS ] [JACK-port]*\n\n");
+	printf ("Options:\n\
+			-a, --affinity <cpus>      run the input thread on the given CPUs,\n\
+			                           e.g. '1' or '0,2-3'\n\
+			-b, --batch                read commands from stdin without prompt,\n\
+			                           exit when all events have been sent\n\
+			-B, --binary <format>      batch mode, read binary MIDI data,\n\
+			                           format is 'raw' or 'timed'\n\
+			-c, --coalesce             send only the last value of a controller\n\
+			                           or pitch-bend per channel and cycle\n\
+			-d, --daemon               run as a service, without prompt and\n\
+			                           stdin, commands are read from --listen\n\
+			                           sockets and fifos\n\
+			-f, --file <path>          batch mode, read commands from file\n\
+			-h, --help                 display this help and exit\n\
+			-i, --input                register a MIDI input port, for 'wait'\n\
+			                           and 'thru'\n\
+			-l, --listen <address>     accept commands on a socket, 'unix:<path>',\n\
+			                           'udp:[host:]<port>', 'tcp:[host:]<port>',\n\
+			                           'osc:[host:]<port>' (OSC over UDP) or a\n\
+			                           named pipe 'fifo:<path>', may be given\n\
+			                           more than once\n\
+			-m, --max-per-cycle <n>[:<bytes>]  max. events (0: any) and bytes\n\
+			                           written per port and cycle, the rest is\n\
+			                           deferred to the next cycle\n\
+			-O, --overflow <mode>      'drop' (default) or 'block' when the\n\
+			                           event queue is full\n\
+			-p, --ports <num>          number of output ports (default: 1, max: 64)\n\
+			-P, --replay <file>        batch mode, send the events of a file written\n\
+			                           with --record, same as '-B timed -f <file>'\n\
+			-q, --queue-size <num>     max. number of queued events per port\n\
+			                           (default: 4096)\n\
+			-r, --rate <bytes/s>       limit the rate of each output port, 'din'\n\
+			                           is 3125 (31250 baud), excess events are\n\
+			                           deferred\n\
+			-R, --record <file>        write all events sent on the output ports\n\
+			                           to a file, with their timing\n\
+			-s, --smf <file>           play a Standard MIDI File, following\n\
+			                           jack transport\n\
+			-S, --sysex-size <bytes>   max. length of SysEx messages (default: 8192)\n\
+			-t, --priority <prio>      realtime priority of the input thread,\n\
+			                           that parses and queues events,\n\
+			                           '[fifo:|rr:]<num>', below JACK's\n\
+			-V, --version              print version information and exit\n\
+			\n");
+	printf ("\n\
+			This tool generates generates custom midi message from stdin\n\
+			and sends them to a JACK-midi port.\n\
+			\n\
+			SysEx messages are given as hex bytes 'F0 .. F7'.\n\
+			\n\
+			Messages can be prefixed with a timestamp, either '@<frame>'\n\
+			(absolute JACK frame-time) or '+<ms>' (milliseconds from now,\n\
+			plus one period). Scheduled messages may be queued in any\n\
+			order. In batch mode relative times are measured from the\n\
+			start of the input.\n\
+			\n\
+			With more than one output port, the ports are named 'out_1'\n\
+			.. 'out_<num>', messages go to the first one unless a port\n\
+			':<n>' follows the timestamp. The n-th JACK-port given on the\n\
+			command-line is connected to the n-th output, excess ones to\n\
+			the last. OSC /midi/raw MIDI messages use the port-id.\n\
+			\n\
+			A JACK-port may also be a regular expression that matches the\n\
+			whole name, e.g. 'a2j:.*USB.*'. The connections are restored\n\
+			when a matching port appears again, e.g. when a USB MIDI\n\
+			interface is re-plugged.\n\
+			\n\
+			'connect <JACK-port>' connects an output port at runtime. On a\n\
+			terminal, commands, macro and port names complete with TAB, and\n\
+			the history is kept in ~/.jack_midi_cmd_history (if built with\n\
+			readline).\n\
+			\n\
+			Binary input is a MIDI byte-stream (running status is\n\
+			supported). With the 'timed' format each message is preceded\n\
+			by a delta-time in audio frames, encoded as variable-length\n\
+			quantity like in Standard MIDI Files. 'F5 <port>' selects the\n\
+			output port (0 is the first) for the following messages.\n\
+			\n\
+			Control sockets accept the same commands as stdin, one per\n\
+			line. UDP datagrams may contain several lines. Replies are\n\
+			sent to the client. The host defaults to localhost. A fifo\n\
+			is created if it does not exist, and stays open when a writer\n\
+			closes it, there are no replies.\n\
+			\n\
+			With --daemon, SIGTERM, SIGINT or SIGHUP quit. When run by a\n\
+			service manager with NOTIFY_SOCKET set (systemd Type=notify),\n\
+			READY=1 is sent once the client is active and the ports given\n\
+			on the command-line are connected.\n\
+			\n\
+			OSC messages: /midi/note, /midi/noteoff, /midi/polypressure,\n\
+			/midi/cc <channel 1..16> <data1> <data2>, /midi/pc,\n\
+			/midi/pressure <channel> <data>, /midi/pitchbend <channel>\n\
+			<0..16383> and /midi/raw <blob>. Bundles are scheduled\n\
+			at their timetag.\n\
+			\n\
+			The 'wait' command waits for a message on the input port that\n\
+			was received after the previous message was sent, and starts\n\
+			with the given hex bytes ('xx' matches any byte). It reports\n\
+			the round-trip time in audio frames. The commands that follow\n\
+			from the same client run after it, other clients are served\n\
+			meanwhile.\n\
+			\n\
+			Input can be forwarded to an output port with 'thru <port>' in\n\
+			the process callback, after applying the rules in order:\n\
+			  rule drop <type> <channel> <range>\n\
+			  rule channel <type> <channel> <range> <new channel>\n\
+			  rule transpose <type> <channel> <range> <semitones>\n\
+			  rule scale <type> <channel> <range> <percent>\n\
+			<type> is any, note, polypressure, cc, pc, pressure, bend or\n\
+			sys. <channel> is 1..16 or '*', and <range> the first data\n\
+			byte (note or controller), '<n>', '<lo>-<hi>' or '*'. Scale\n\
+			applies to the last data byte, for bend to the 14 bit value.\n\
+			\n\
+			A macro is a sequence of messages separated by ';', e.g.\n\
+			'macro scene1 CC 7 100; +10 :2 N 60 100'. It is encoded when\n\
+			it is defined, and 'fire scene1' queues all its messages at\n\
+			once, so they are sent in the same cycle. Timestamps in a\n\
+			macro are relative to the time it is fired.\n\
+			\n\
+			'clock start' sends MIDI clock (24 per quarter note) from the\n\
+			process callback, on the port given with ':<n>', at 120 BPM\n\
+			until 'clock tempo <bpm>' changes the tempo at the next\n\
+			clock. 'clock locate' sends a song position in 16th notes.\n\
+			'pattern 1 24 a - b -' fires macro a, waits, fires b, .. one\n\
+			step every 24 clocks, aligned to the song position.\n\
+			\n\
+			'stats' reports the latency of sent events, from the time they\n\
+			were queued (or their due time, if that is later) to the time\n\
+			they are sent, and the JACK DSP load. 'metrics' prints the\n\
+			same in Prometheus text format, e.g. for a 'tcp:' listener.\n\
+			\n\
+			A MIDI file is played when jack transport is rolling, and\n\
+			follows transport relocation. The 'play', 'stop' and 'locate'\n\
+			commands control jack transport.\n\
+			\n");
+	printf ("Report bugs to Robin Gareus <robin@gareus.org>\n"
+			"Website and manual: <https://github.com/x42/jack-midi-cmd>\n"
+			);
+	exit (status);
+}
+
+static int decode_switches (int argc, char **argv) {
+	int c;
+
+	while ((c = getopt_long (argc, argv,
+					"a:"	/* affinity */
+					"b"	/* batch */
+					"B:"	/* binary */
+					"c"	/* coalesce */
+					"d"	/* daemon */
+					"f:"	/* file */
+					"h"	/* help */
+					"i"	/* input */
+					"l:"	/* listen */
+					"m:"	/* max-per-cycle */
+					"O:"	/* overflow */
+					"p:"	/* ports */
+					"q:"	/* queue-size */
+					"r:"	/* rate */
+					"R:"	/* record */
+					"P:"	/* replay */
+					"s:"	/* smf */
+					"S:"	/* sysex-size */
+					"t:"	/* priority */
+					"V",	/* version */
+					long_options, (int *) 0)) != EOF)
+	{
+		switch (c)
+		{
+
+			case 'V':
+				printf ("jack_midi_command version %s\n\n", VERSION);
+				printf ("Copyright (C) GPL 2015 Robin Gareus <robin@gareus.org>\n");
+				exit (0);
+
+			case 'a':
+#ifdef __linux__
+				if (parse_cpus (optarg)) {
+					fprintf (stderr, "invalid cpu list '%s'\n", optarg);
+					usage (EXIT_FAILURE);
+				}
+#else
+				fprintf (stderr, "--affinity is not supported on this platform\n");
+#endif
+				break;
+
+			case 'b':
+				batch = 1;
+				break;
+
+			case 'B':
+				if (!strcmp (optarg, "raw")) {
+					binary_mode = BinaryRaw;
+				} else if (!strcmp (optarg, "timed")) {
+					binary_mode = BinaryTimed;
+				} else {
+					fprintf (stderr, "invalid binary format '%s'\n", optarg);
+					usage (EXIT_FAILURE);
+				}
+				batch = 1;
+				break;
+
+			case 'c':
+				coalesce = 1;
+				break;
+
+			case 'd':
+				daemon_mode = 1;
+				break;
+
+			case 'f':
+				batch = 1;
+				batch_file = optarg;
+				break;
+
+			case 'h':
+				usage (0);
+				break;
+
+			case 'i':
+				midi_in.enabled = 1;
+				break;
+
+			case 'l':
+				if (n_listen_specs >= MAX_LISTEN) {
+					fprintf (stderr, "too many listen addresses\n");
+					usage (EXIT_FAILURE);
+				}
+				listen_specs[n_listen_specs++] = optarg;
+				break;
+
+			case 'm':
+				{
+					char *end;
+					const long ev = strtol (optarg, &end, 10);
+					if (end == optarg || ev < 0 || (*end && *end != ':')) {
+						fprintf (stderr, "invalid cycle budget '%s'\n", optarg);
+						usage (EXIT_FAILURE);
+					}
+					budget_events = ev;
+					if (*end == ':' && (budget_bytes = atoi (end + 1)) < 1) {
+						fprintf (stderr, "invalid cycle budget '%s'\n", optarg);
+						usage (EXIT_FAILURE);
+					}
+				}
+				break;
+
+			case 'O':
+				if (!strcmp (optarg, "drop")) {
+					overflow_policy = OverflowDrop;
+				} else if (!strcmp (optarg, "block")) {
+					overflow_policy = OverflowBlock;
+				} else {
+					fprintf (stderr, "invalid overflow mode '%s'\n", optarg);
+					usage (EXIT_FAILURE);
+				}
+				overflow_set = 1;
+				break;
+
+			case 'p':
+				n_outs = atoi (optarg);
+				if (n_outs < 1 || n_outs > MAX_PORTS) {
+					fprintf (stderr, "invalid number of ports %s\n", optarg);
+					usage (EXIT_FAILURE);
+				}
+				break;
+
+			case 'q':
+				queue_size = atoi (optarg);
+				if (queue_size < 1 || queue_size > JACK_MIDI_QUEUE_MAX) {
+					fprintf (stderr, "invalid queue-size %s\n", optarg);
+					usage (EXIT_FAILURE);
+				}
+				break;
+
+			case 'r':
+				if (!strcmp (optarg, "din")) {
+					byte_rate = 3125;
+				} else if ((byte_rate = atoi (optarg)) < 1) {
+					fprintf (stderr, "invalid rate %s\n", optarg);
+					usage (EXIT_FAILURE);
+				}
+				break;
+
+			case 'R':
+				capture.path = optarg;
+				break;
+
+			case 'P':
+				binary_mode = BinaryTimed;
+				batch = 1;
+				batch_file = optarg;
+				break;
+
+			case 's':
+				smf_file = optarg;
+				break;
+
+			case 't':
+				if (parse_priority (optarg)) {
+					fprintf (stderr, "invalid priority '%s'\n", optarg);
+					usage (EXIT_FAILURE);
+				}
+				break;
+
+			case 'S':
+				max_sysex = atoi (optarg);
+				if (max_sysex < 2 || max_sysex > JACK_MIDI_QUEUE_MAX) {
+					fprintf (stderr, "invalid sysex-size %s\n", optarg);
+					usage (EXIT_FAILURE);
+				}
+				break;
+
+			default:
+				usage (EXIT_FAILURE);
+		}
+	}
+
+	return optind;
+}
+
+/**
+ * wait until the process callback made progress, or `ms` passed,
+ * to be called with queue_lock held.
+ */
+static void wait_for_process(uint32_t ms) {
+	struct timespec timeout;
+	clock_gettime (CLOCK_REALTIME, &timeout);
+	timeout.tv_sec += ms / 1000;
+	timeout.tv_nsec += (ms % 1000) * 1000000;
+	if (timeout.tv_nsec >= 1000000000) {
+		timeout.tv_nsec -= 1000000000;
+		++timeout.tv_sec;
+	}
+	pthread_cond_timedwait (&queue_drained, &queue_lock, &timeout);
+}
+
+static __thread int queue_txn = 0;
+
+/* assign queues to the calling thread, allocated on first use
+ * except for the first thread's, see alloc_queues() */
+static int source_claim(void) {
+	const int s = __atomic_fetch_add(&n_sources, 1, __ATOMIC_RELAXED);
+	uint32_t i;
+	if (s >= MAX_SOURCES) {
+		fprintf(stderr, "too many threads queue events, max. %d\n", MAX_SOURCES);
+		queue_src = -2;
+		return -1;
+	}
+	for (i = 0; s > 0 && i < n_outs; ++i) {
+		event_queue_t *q = &outs[i].queue[s];
+		if (!(q->buf = alloc_locked(queue_bytes))) {
+			fprintf(stderr, "cannot allocate event queue.\n");
+			queue_src = -2;
+			return -1;
+		}
+		q->size = queue_bytes;
+		q->mask = queue_bytes - 1;
+	}
+	queue_src = s;
+	return 0;
+}
+
+/* the calling thread's queue of output port `port` */
+static inline event_queue_t *source_queue(uint32_t port) {
+	if (queue_src < 0 && (queue_src == -2 || source_claim())) {
+		return NULL;
+	}
+	return &outs[port].queue[queue_src];
+}
+
+static void queue_publish(event_queue_t *q) {
+	if (q->write != q->head) {
+		__atomic_store_n(&q->head, q->write, __ATOMIC_RELEASE);
+	}
+}
+
+/* queue several events at once */
+static void queue_begin(void) {
+	queue_txn = 1;
+}
+
+static void queue_commit(void) {
+	uint32_t i;
+	queue_txn = 0;
+	for (i = 0; queue_src >= 0 && i < n_outs; ++i) {
+		queue_publish(&outs[i].queue[queue_src]);
+	}
+}
+
+/* the owners of the control thread's clients, see owners[] */
+static uint32_t owner_queued[MAX_OWNERS];      // messages
+static jack_nframes_t owner_since[MAX_OWNERS]; // when it was claimed
+static uint8_t owner_claimed[MAX_OWNERS];
+static __thread uint8_t queue_owner = 0; // tags the records queued, 0: none
+
+/* an unused id whose messages are all done, 0 if there is none */
+static uint8_t owner_claim(void) {
+	int i;
+	for (i = 1; i < MAX_OWNERS; ++i) {
+		if (!owner_claimed[i] && __atomic_load_n(&owners[i].done, __ATOMIC_ACQUIRE) == owner_queued[i]) {
+			owner_claimed[i] = 1;
+			owner_since[i] = jack_frame_time(j_client);
+			return i;
+		}
+	}
+	return 0;
+}
+
+static void owner_release(uint8_t owner) {
+	owner_claimed[owner] = 0;
+}
+
+/* when the last message of `owner` was sent, or it was claimed */
+static jack_nframes_t owner_last_sent(uint8_t owner) {
+	const jack_nframes_t sent = __atomic_load_n(&owners[owner].last_sent, __ATOMIC_RELAXED);
+	return (int32_t)(sent - owner_since[owner]) > 0 ? sent : owner_since[owner];
+}
+
+/* discard input received before a new message is sent, see wait_reply() */
+static void input_flush(void) {
+	event_queue_t *q = &midi_in.queue;
+	__atomic_store_n(&q->tail, __atomic_load_n(&q->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+static __thread event_queue_t *queue_reserved = NULL; // see queue_reserve()
+
+/**
+ * start a record of `size` bytes in the calling thread's queue of `port`.
+ * returns where to write the data, the record is queued with queue_finish().
+ * NULL if the queue is full.
+ */
+static inline uint8_t *queue_reserve(uint32_t port, uint32_t flags, jack_nframes_t time, uint32_t size) {
+	const uint32_t hdr = (size << EV_FLAGBITS) | flags | EV_STAMPED | (queue_owner ? EV_OWNED : 0);
+	const uint32_t len = varint_len(hdr) + ((flags & EV_SCHEDULED) ? sizeof(jack_nframes_t) : 0) + sizeof(jack_nframes_t) + (queue_owner ? 1 : 0) + size;
+	event_queue_t *q = source_queue(port);
+	int64_t pad = q ? queue_space(q, len) : -1;
+	uint8_t *rec;
+
+	if (pad < 0 && q && overflow_policy == OverflowBlock) {
+		/* a transaction larger than the queue is delivered in parts */
+		queue_publish(q);
+		pthread_mutex_lock (&queue_lock);
+		while ((pad = queue_space(q, len)) < 0 && client_state != Exit) {
+			wait_for_process(100);
+		}
+		pthread_mutex_unlock (&queue_lock);
+	}
+
+	if (pad < 0) {
+		__atomic_fetch_add(&stats.ring_full, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	if (batch && midi_in.enabled && queue_src == 0) {
+		input_flush(); // a 'wait' blocks, see wait_reply()
+	}
+
+	queue_reserved = q;
+	rec = queue_put_header(q, pad, hdr, time, jack_frame_time(j_client));
+	if (queue_owner) {
+		*rec++ = queue_owner;
+		++q->write;
+	}
+	return rec;
+}
+
+static inline void queue_finish(uint32_t size) {
+	queue_reserved->write += size;
+	if (!queue_txn) {
+		queue_publish(queue_reserved);
+	}
+}
+
+/* write and publish a record, see queue_event() */
+static int queue_record(uint32_t port, uint32_t flags, jack_nframes_t time, const uint8_t *data, uint32_t size) {
+	uint8_t *rec = queue_reserve(port, flags, time, size);
+	if (!rec) {
+		return -1;
+	}
+	memcpy(rec, data, size);
+	queue_finish(size);
+	return 0;
+}
+
+/* `n` messages were queued */
+static inline void queue_count(uint32_t n) {
+	__atomic_fetch_add(&stats.queued, n, __ATOMIC_RELAXED);
+	if (queue_owner) {
+		owner_queued[queue_owner] += n;
+	}
+}
+
+static int queue_event(const my_midi_event_t *me) {
+	if (queue_record(me->port, me->scheduled ? EV_SCHEDULED : 0, me->time, me->buffer, me->size)) {
+		return -1;
+	}
+	queue_count(1);
+	return 0;
+}
+
+/* length of a message with the given status byte, 1 for sysex (F0) */
+#define MIDI_STATUS_SIZE(s) \
+	(((s) & 0xf0) == 0xc0 || ((s) & 0xf0) == 0xd0 ? 2 : \
+	 ((s) & 0xf0) != 0xf0 ? 3 : \
+	 (s) == 0xf1 || (s) == 0xf3 ? 2 : \
+	 (s) == 0xf2 ? 3 : 1)
+
+/* all queued and generated events have been sent, or dropped */
+static int all_sent(void) {
+	uint32_t i;
+	int s;
+	for (i = 0; i < n_outs; ++i) {
+		for (s = 0; s < MAX_SOURCES; ++s) {
+			const event_queue_t *q = &outs[i].queue[s];
+			if (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+				return 0; // control records
+			}
+		}
+	}
+	return __atomic_load_n(&stats.queued, __ATOMIC_RELAXED) + __atomic_load_n(&stats.generated, __ATOMIC_RELAXED) ==
+		__atomic_load_n(&stats.sent, __ATOMIC_RELAXED) + __atomic_load_n(&stats.port_dropped, __ATOMIC_RELAXED)
+		+ __atomic_load_n(&stats.coalesced, __ATOMIC_RELAXED);
+}
+
+/* a copy of the latency histogram, counts are consistent with the buckets */
+typedef struct {
+	uint32_t bucket[LAT_BUCKETS];
+	uint32_t count;
+	uint32_t max;
+	uint64_t sum;
+} lat_snapshot_t;
+
+static void lat_snapshot(lat_snapshot_t *ls) {
+	uint32_t i;
+	ls->count = 0;
+	ls->max = __atomic_load_n(&latency.max, __ATOMIC_RELAXED);
+	ls->sum = __atomic_load_n(&latency.sum, __ATOMIC_RELAXED);
+	for (i = 0; i < LAT_BUCKETS; ++i) {
+		ls->bucket[i] = __atomic_load_n(&latency.bucket[i], __ATOMIC_RELAXED);
+		ls->count += ls->bucket[i];
+	}
+}
+
+/* upper bound of the `q` quantile, in frames */
+static uint32_t lat_quantile(const lat_snapshot_t *ls, double q) {
+	const uint64_t rank = ceil(q * ls->count);
+	uint64_t n = 0;
+	uint32_t i;
+	for (i = 0; i < LAT_BUCKETS; ++i) {
+		n += ls->bucket[i];
+		if (n >= rank && n > 0) {
+			const uint32_t v = lat_bucket_max(i);
+			return v < ls->max ? v : ls->max;
+		}
+	}
+	return ls->max;
+}
+
+static void format_stats(char *buf, size_t len) {
+	lat_snapshot_t ls;
+	snprintf(buf, len, " -- queued: %u generated: %u sent: %u late: %u\n"
+			" -- dropped (queue full): %u dropped (too large): %u\n"
+			" -- deferred (port buffer full): %u coalesced: %u\n"
+			" -- bytes (with running status): %u\n",
+			__atomic_load_n(&stats.queued, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats.generated, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats.sent, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats.late, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats.ring_full, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats.port_dropped, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats.port_deferred, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats.coalesced, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats.wire_bytes, __ATOMIC_RELAXED));
+	if (byte_rate > 0) {
+		const size_t n = strlen(buf);
+		snprintf(buf + n, len - n, " -- cycles deferred (rate limit): %u\n",
+				__atomic_load_n(&stats.rate_limited, __ATOMIC_RELAXED));
+	}
+	{
+		const size_t n = strlen(buf);
+		snprintf(buf + n, len - n, " -- cycles deferred (budget): %u xruns: %u\n",
+				__atomic_load_n(&stats.budget_limited, __ATOMIC_RELAXED),
+				__atomic_load_n(&stats.xruns, __ATOMIC_RELAXED));
+	}
+	if (midi_in.enabled) {
+		const size_t n = strlen(buf);
+		snprintf(buf + n, len - n, " -- received: %u dropped (input queue full): %u\n"
+				" -- thru: %u dropped (thru): %u\n",
+				__atomic_load_n(&stats.received, __ATOMIC_RELAXED),
+				__atomic_load_n(&stats.in_dropped, __ATOMIC_RELAXED),
+				__atomic_load_n(&stats.thru, __ATOMIC_RELAXED),
+				__atomic_load_n(&stats.thru_dropped, __ATOMIC_RELAXED));
+	}
+	lat_snapshot(&ls);
+	if (ls.count > 0) {
+		const double us = 1e6 / jack_get_sample_rate(j_client);
+		const uint32_t p50 = lat_quantile(&ls, .5);
+		const uint32_t p99 = lat_quantile(&ls, .99);
+		const uint32_t cycles = __atomic_load_n(&latency.cycles, __ATOMIC_RELAXED);
+		const size_t n = strlen(buf);
+		snprintf(buf + n, len - n, " -- latency (frames/us) p50: %u/%.0f p99: %u/%.0f max: %u/%.0f\n"
+				" -- events per cycle avg: %.1f max: %u, DSP load: %.1f%%\n",
+				p50, p50 * us, p99, p99 * us, ls.max, ls.max * us,
+				cycles > 0 ? __atomic_load_n(&stats.sent, __ATOMIC_RELAXED) / (double)cycles : 0,
+				__atomic_load_n(&latency.events_max, __ATOMIC_RELAXED),
+				jack_cpu_load(j_client));
+	}
+}
+
+/* replies to commands go to stdout, or back to the client that sent them */
+static struct {
+	int fd;                       // -1: stdout
+	int dgram;                    // reply with a single datagram
+	struct sockaddr_storage addr; // dgram: sender
+	socklen_t addrlen;
+	char buf[4096];
+	size_t len;
+} reply_to = { .fd = -1 };
+
+static void reply(const char *fmt, ...) {
+	va_list ap;
+	int n;
+	va_start(ap, fmt);
+	if (reply_to.fd < 0) {
+		vprintf(fmt, ap);
+		va_end(ap);
+		return;
+	}
+	n = vsnprintf(&reply_to.buf[reply_to.len], sizeof(reply_to.buf) - reply_to.len, fmt, ap);
+	va_end(ap);
+	if (n > 0) {
+		reply_to.len += n;
+		if (reply_to.len >= sizeof(reply_to.buf)) {
+			reply_to.len = sizeof(reply_to.buf) - 1; // truncated
+		}
+	}
+}
+
+static void reply_flush(void) {
+	if (reply_to.fd < 0 || reply_to.len == 0) {
+		fflush(stdout);
+		return;
+	}
+	if (reply_to.dgram) {
+		sendto(reply_to.fd, reply_to.buf, reply_to.len, MSG_DONTWAIT,
+				(struct sockaddr *)&reply_to.addr, reply_to.addrlen);
+	} else {
+		/* never block on a slow client */
+		send(reply_to.fd, reply_to.buf, reply_to.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	reply_to.len = 0;
+}
+
+/**
+ * single pass tokenizer for the command parser
+ */
+typedef struct {
+	const char *line;
+	const char *p;
+	const char *error;     // error message, if any
+	const char *error_pos;
+	uint32_t max;          // range, for "value out of range" errors
+} lexer_t;
+
+static inline void lex_space(lexer_t *lx) {
+	while (*lx->p == ' ' || *lx->p == '\t') {
+		++lx->p;
+	}
+}
+
+static inline int lex_is_end(char c) {
+	return c == '\0' || c == '\n' || c == '\r' || c == '#';
+}
+
+static inline int lex_is_delim(char c) {
+	return c == ' ' || c == '\t' || lex_is_end(c);
+}
+
+/* true if only whitespace or a comment remains */
+static int lex_end(lexer_t *lx) {
+	lex_space(lx);
+	return lex_is_end(*lx->p);
+}
+
+static int lex_error(lexer_t *lx, const char *pos, const char *msg) {
+	lx->error = msg;
+	lx->error_pos = pos;
+	return -1;
+}
+
+/* read the next whitespace delimited word */
+static size_t lex_word(lexer_t *lx, const char **word) {
+	lex_space(lx);
+	*word = lx->p;
+	while (!lex_is_delim(*lx->p)) {
+		++lx->p;
+	}
+	return lx->p - *word;
+}
+
+/**
+ * parse an unsigned integer, decimal or with 0x prefix hexadecimal.
+ * if base is 16, the prefix is optional.
+ * This does not use strtol() to remain locale independent.
+ */
+static int lex_uint(lexer_t *lx, int base, uint32_t max, uint32_t *val) {
+	const char *start;
+	const char *digits;
+	uint64_t v = 0;
+
+	lex_space(lx);
+	start = lx->p;
+	if (lx->p[0] == '0' && (lx->p[1] == 'x' || lx->p[1] == 'X')) {
+		base = 16;
+		lx->p += 2;
+	}
+	digits = lx->p;
+
+	while (1) {
+		const char c = *lx->p;
+		int d;
+		if (c >= '0' && c <= '9') {
+			d = c - '0';
+		} else if (base == 16 && c >= 'a' && c <= 'f') {
+			d = c - 'a' + 10;
+		} else if (base == 16 && c >= 'A' && c <= 'F') {
+			d = c - 'A' + 10;
+		} else {
+			break;
+		}
+		if (v <= UINT32_MAX) {
+			v = v * base + d;
+		}
+		++lx->p;
+	}
+
+	if (lx->p == digits || !lex_is_delim(*lx->p)) {
+		return lex_error(lx, start, lx->p == start && lex_is_end(*lx->p)
+				? "missing parameter"
+				: "invalid number");
+	}
+	if (v > max) {
+		lx->max = max;
+		return lex_error(lx, start, "value out of range");
+	}
+	*val = v;
+	return 0;
+}
+
+/**
+ * parse an unsigned decimal with optional fraction
+ */
+static int lex_decimal(lexer_t *lx, double *val) {
+	const char *start = lx->p;
+	double v = 0;
+	double scale = 1;
+	int n = 0;
+
+	for (; *lx->p >= '0' && *lx->p <= '9'; ++lx->p, ++n) {
+		v = v * 10 + (*lx->p - '0');
+	}
+	if (*lx->p == '.') {
+		for (++lx->p; *lx->p >= '0' && *lx->p <= '9'; ++lx->p, ++n) {
+			scale /= 10;
+			v += (*lx->p - '0') * scale;
+		}
+	}
+	if (n == 0 || !lex_is_delim(*lx->p)) {
+		return lex_error(lx, start, "invalid number");
+	}
+	*val = v;
+	return 0;
+}
+
+static int macro_def = 0; // relative timestamps are offsets, see lex_macro()
+
+/**
+ * parse optional timestamp prefix
+ *  "@<frame>" absolute jack frame-time
+ *  "+<ms>"    milliseconds from now, or from the start in batch mode
+ *
+ * Relative times include one period of latency: a message stamped "now"
+ * is sent at the same offset in the next cycle, so the timing of
+ * consecutive messages is preserved regardless of the period size.
+ */
+static int lex_timestamp(lexer_t *lx, my_midi_event_t *event) {
+	event->time = 0;
+	event->scheduled = 0;
+	event->port = 0;
+
+	lex_space(lx);
+	if (*lx->p == '@') {
+		uint32_t frame;
+		++lx->p;
+		if (lex_uint(lx, 10, UINT32_MAX, &frame)) {
+			return -1;
+		}
+		event->time = frame;
+		event->scheduled = 1;
+	}
+	else if (*lx->p == '+') {
+		double ms;
+		++lx->p;
+		if (lex_decimal(lx, &ms)) {
+			return -1;
+		}
+		const jack_nframes_t now = macro_def
+			? 0
+			: batch
+			? batch_start
+			: jack_frame_time(j_client) + jack_get_buffer_size(j_client);
+		event->time = now + rint(ms * jack_get_sample_rate(j_client) / 1000.0);
+		event->scheduled = 1;
+	}
+	return 0;
+}
+
+/**
+ * optional output port ":<n>", 1-based
+ */
+static int lex_port(lexer_t *lx, my_midi_event_t *event) {
+	uint32_t port;
+	lex_space(lx);
+	if (*lx->p != ':') {
+		return 0;
+	}
+	++lx->p;
+	if (lex_uint(lx, 10, n_outs, &port)) {
+		return -1;
+	}
+	if (port == 0) {
+		return lex_error(lx, lx->p - 1, "ports are numbered from 1");
+	}
+	event->port = port - 1;
+	return 0;
+}
+
+/**
+ * command table
+ */
+enum {
+	CmdExit,
+	CmdReconnect,
+	CmdConnect,
+	CmdHelp,
+	CmdStats,
+	CmdPlay,
+	CmdStop,
+	CmdLocate,
+	CmdWait,
+	CmdThru,
+	CmdRule,
+	CmdRules,
+	CmdMacro,
+	CmdFire,
+	CmdMacros,
+	CmdMetrics,
+	CmdClock,
+	CmdPattern,
+	CmdMidi,
+	CmdSysex
+};
+
+/**
+ * parse a system exclusive message "F0 <hex data bytes> F7",
+ * the leading F0 has already been consumed. It has `*size` bytes,
+ * written to `data` unless that is NULL.
+ */
+static int lex_sysex_data(lexer_t *lx, jack_midi_data_t *data, uint32_t *size) {
+	const char *pos = lx->p;
+	uint32_t len = 1;
+	uint32_t byte = 0;
+
+	if (data) {
+		data[0] = 0xf0;
+	}
+	while (!lex_end(lx)) {
+		pos = lx->p;
+		if (len >= (uint32_t)max_sysex) {
+			return lex_error(lx, pos, "message too long");
+		}
+		if (lex_uint(lx, 16, 0xff, &byte)) {
+			return -1;
+		}
+		if (byte != 0xf7 && (byte & 0x80)) {
+			lx->max = 0x7f;
+			return lex_error(lx, pos, "value out of range");
+		}
+		if (data) {
+			data[len] = byte;
+		}
+		++len;
+		if (byte == 0xf7) {
+			break;
+		}
+	}
+	if (byte != 0xf7) {
+		return lex_error(lx, lx->p, "missing F7");
+	}
+	*size = len;
+	return 0;
+}
+
+/* a sysex message of a macro */
+static int lex_sysex(lexer_t *lx, my_midi_event_t *event) {
+	static __thread jack_midi_data_t *sysex = NULL;
+	uint32_t size;
+
+	if (!sysex && !(sysex = malloc(max_sysex))) {
+		return lex_error(lx, lx->p, "out of memory");
+	}
+	if (lex_sysex_data(lx, sysex, &size)) {
+		return -1;
+	}
+	event->size = size;
+	event->buffer = sysex;
+	return 0;
+}
+
+/* MIDI messages of the command set, one encoder each:
+ *   X(id, command, status, parameters, hex, args, help)
+ * with status 0 the first parameter is the status byte. The encoder
+ * checks the whole line before it reserves the record in the queue,
+ * a line with an error does not touch the queue. The length follows
+ * from the status byte at compile time. */
+#define MIDI_MESSAGES(X) \
+	X(NoteOn,  "N",  0x90, 2, 0, "<note> <velocity>",  "note on, channel 1") \
+	X(NoteOff, "n",  0x80, 2, 0, "<note> <velocity>",  "note off, channel 1") \
+	X(Control, "CC", 0xb0, 2, 0, "<control> <value>",  "control change, channel 1") \
+	X(Raw3,    ".",  0,    3, 1, "<hex> <hex> <hex>",  "3 byte message") \
+	X(Raw2,    "2",  0,    2, 0, "<status> <data>",    "2 byte message") \
+	X(Raw1,    "1",  0,    1, 0, "<status>",           "1 byte message")
+
+#define MIDI_MESSAGE_SIZE(status, nparam) ((status) ? (nparam) + 1 : (nparam))
+
+/* returns -1 on a syntax error, nothing is queued.
+ * If the queue is full the message is dropped. */
+#define MIDI_ENCODER(id, name, status, nparam, hex, args, help) \
+	_Static_assert(!(status) || MIDI_STATUS_SIZE(status) == (nparam) + 1, "'" name "': the parameters do not match the status byte"); \
+	static int encode_##id(lexer_t *lx, const my_midi_event_t *me) { \
+		jack_midi_data_t msg[MIDI_MESSAGE_SIZE(status, nparam)]; \
+		const uint32_t first = sizeof(msg) - (nparam); \
+		uint8_t *rec; \
+		uint32_t val; \
+		uint32_t i; \
+		for (i = 0; i < (nparam); ++i) { \
+			if (lex_uint(lx, (hex) ? 16 : 10, (i == 0 && !(status)) ? 0xff : 0x7f, &val)) { \
+				return -1; \
+			} \
+			msg[first + i] = val; \
+		} \
+		if (!lex_end(lx)) { \
+			return lex_error(lx, lx->p, "unexpected characters"); \
+		} \
+		if (status) { \
+			msg[0] = (status); \
+		} \
+		if ((rec = queue_reserve(me->port, me->scheduled ? EV_SCHEDULED : 0, me->time, sizeof(msg)))) { \
+			memcpy(rec, msg, sizeof(msg)); \
+			queue_finish(sizeof(msg)); \
+			queue_count(1); \
+		} \
+		return 0; \
+	}
+
+MIDI_MESSAGES(MIDI_ENCODER)
+
+/* the sysex message is checked first, and then lexed again
+ * directly into the record */
+static int encode_sysex(lexer_t *lx, const my_midi_event_t *me) {
+	const char *start = lx->p;
+	uint8_t *rec;
+	uint32_t size;
+
+	if (lex_sysex_data(lx, NULL, &size)) {
+		return -1;
+	}
+	if (!lex_end(lx)) {
+		return lex_error(lx, lx->p, "unexpected characters");
+	}
+	if ((rec = queue_reserve(me->port, me->scheduled ? EV_SCHEDULED : 0, me->time, size))) {
+		lx->p = start;
+		lex_sysex_data(lx, rec, &size);
+		queue_finish(size);
+		queue_count(1);
+	}
+	return 0;
+}
+
+static const struct parser_cmd {
+	const char *name;
+	int type;
+	uint8_t status; // CmdMidi: status byte, 0 if it's the first parameter
+	uint8_t nparam; // CmdMidi: number of parameters (= bytes)
+	uint8_t hex;    // CmdMidi: parameters are hexadecimal
+	const char *args;
+	const char *help;
+	int (*encode)(lexer_t *, const my_midi_event_t *); // CmdMidi and CmdSysex
+} parser_cmds[] = {
+	{ "exit",      CmdExit,      0,    0, 0, "",                    "quit", NULL },
+	{ "reconnect", CmdReconnect, 0,    0, 0, "",                    "connect to the ports given on the command-line", NULL },
+	{ "connect",   CmdConnect,   0,    0, 0, "<jack-port>",         "connect the output port given with ':<n>'", NULL },
+	{ "help",      CmdHelp,      0,    0, 0, "",                    "print this help", NULL },
+	{ "stats",     CmdStats,     0,    0, 0, "",                    "print event statistics", NULL },
+	{ "metrics",   CmdMetrics,   0,    0, 0, "",                    "print statistics in Prometheus text format", NULL },
+	{ "play",      CmdPlay,      0,    0, 0, "",                    "start jack transport", NULL },
+	{ "stop",      CmdStop,      0,    0, 0, "",                    "stop jack transport", NULL },
+	{ "locate",    CmdLocate,    0,    0, 0, "<seconds>",           "relocate jack transport", NULL },
+	{ "wait",      CmdWait,      0,    0, 1, "<ms> [<hex> ..]",     "wait for a reply on the input port", NULL },
+	{ "thru",      CmdThru,      0,    0, 0, "<port>",              "forward input to an output port, 0: off", NULL },
+	{ "rule",      CmdRule,      0,    0, 0, "<action> ..",         "add a thru rule, 'rule clear' removes all", NULL },
+	{ "rules",     CmdRules,     0,    0, 0, "",                    "list thru rules", NULL },
+	{ "macro",     CmdMacro,     0,    0, 0, "<name> <msg> [; ..]", "define a macro", NULL },
+	{ "fire",      CmdFire,      0,    0, 0, "<name>",              "send all messages of a macro", NULL },
+	{ "macros",    CmdMacros,    0,    0, 0, "",                    "list macros", NULL },
+	{ "clock",     CmdClock,     0,    0, 0, "<op> [<value>]",      "MIDI clock: start, stop, continue, tempo <bpm>, locate <16th>", NULL },
+	{ "pattern",   CmdPattern,   0,    0, 0, "<n> <ticks> <macros>", "step through macros every <ticks> clocks, '-': rest, 'off'", NULL },
+#define MIDI_COMMAND(id, name, status, nparam, hex, args, help) \
+	{ name, CmdMidi, status, nparam, hex, args, help, encode_##id },
+	MIDI_MESSAGES(MIDI_COMMAND)
+#undef MIDI_COMMAND
+	{ "F0",        CmdSysex,     0,    0, 1, "<hex data> F7",       "system exclusive message", encode_sysex },
+};
+
+static const struct parser_cmd *lex_command(lexer_t *lx) {
+	const char *word;
+	const size_t len = lex_word(lx, &word);
+	size_t i;
+
+	for (i = 0; i < sizeof(parser_cmds) / sizeof(parser_cmds[0]); ++i) {
+		const struct parser_cmd *cmd = &parser_cmds[i];
+		if (strlen(cmd->name) != len) {
+			continue;
+		}
+		if (cmd->type == CmdSysex ? !strncasecmp(word, cmd->name, len) : !memcmp(word, cmd->name, len)) {
+			return cmd;
+		}
+	}
+	lex_error(lx, word, "unknown command, try 'help'");
+	return NULL;
+}
+
+static void print_help(void) {
+	size_t i;
+	reply(" -- Commands:\n");
+	for (i = 0; i < sizeof(parser_cmds) / sizeof(parser_cmds[0]); ++i) {
+		char cmd[32];
+		snprintf(cmd, sizeof(cmd), "%s %s", parser_cmds[i].name, parser_cmds[i].args);
+		reply("  %-28s %s\n", cmd, parser_cmds[i].help);
+	}
+	reply(" -- Messages can be prefixed with '@<frame>' or '+<ms>',\n"
+			" -- followed by the output port ':<n>'.\n");
+}
+
+/**
+ * parse "<timeout ms> [<hex> ..]", 'xx' is a wildcard
+ */
+#define WAIT_PATTERN (16)
+
+static int lex_pattern(lexer_t *lx, uint32_t *timeout, int16_t *pattern, int *n) {
+	if (lex_uint(lx, 10, 60000, timeout)) {
+		return -1;
+	}
+	for (*n = 0; !lex_end(lx); ++*n) {
+		uint32_t byte;
+		if (*n == WAIT_PATTERN) {
+			return lex_error(lx, lx->p, "pattern too long");
+		}
+		if ((lx->p[0] == 'x' || lx->p[0] == 'X') && (lx->p[1] == 'x' || lx->p[1] == 'X') && lex_is_delim(lx->p[2])) {
+			pattern[*n] = -1;
+			lx->p += 2;
+			continue;
+		}
+		if (lex_uint(lx, 16, 0xff, &byte)) {
+			return -1;
+		}
+		pattern[*n] = byte;
+	}
+	return 0;
+}
+
+static int64_t ms_until(const struct timespec *deadline) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+/**
+ * a 'wait' command: once the messages its client queued have been sent,
+ * wait for a message on the input port that arrived after the last one
+ * was sent and matches `pattern`. In the control loop each client has
+ * its own, and its further input is paused, batch mode uses wait_reply().
+ */
+#define WAIT_REPLY_MAX (64) // bytes of the reply that are printed
+
+typedef struct {
+	int active;
+	uint8_t owner;            // the client's, see owners[]
+	uint32_t queued;          // its messages queued before the 'wait'
+	int sent;                 // they were sent
+	int found;
+	jack_nframes_t last_sent; // once sent, the time of the last one
+	struct timespec deadline;
+	uint32_t timeout;         // ms
+	int16_t pattern[WAIT_PATTERN];
+	int n;
+	jack_nframes_t rtt;       // found: the reply
+	uint32_t size;
+	uint8_t data[WAIT_REPLY_MAX];
+} wait_t;
+
+static int n_waiting = 0; // control thread: active waits
+
+static void wait_start(wait_t *w, uint32_t timeout, const int16_t *pattern, int n) {
+	clock_gettime(CLOCK_MONOTONIC, &w->deadline);
+	w->deadline.tv_sec += timeout / 1000;
+	w->deadline.tv_nsec += (timeout % 1000) * 1000000;
+	if (w->deadline.tv_nsec >= 1000000000) {
+		w->deadline.tv_nsec -= 1000000000;
+		++w->deadline.tv_sec;
+	}
+	memcpy(w->pattern, pattern, n * sizeof(int16_t));
+	w->n = n;
+	w->timeout = timeout;
+	w->owner = queue_owner;
+	w->queued = owner_queued[queue_owner];
+	w->sent = 0;
+	w->found = 0;
+	w->last_sent = jack_frame_time(j_client); // no owner, nothing to send
+	w->active = 1;
+	if (n_waiting++ == 0) {
+		__atomic_store_n(&midi_in.waiting, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void wait_stop(wait_t *w) {
+	w->active = 0;
+	if (--n_waiting == 0) {
+		__atomic_store_n(&midi_in.waiting, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/* the reply was found, or the time is up */
+static int wait_done(const wait_t *w) {
+	return w->found || ms_until(&w->deadline) <= 0 || client_state == Exit;
+}
+
+static void wait_report(const wait_t *w) {
+	uint32_t i;
+	if (!w->found) {
+		reply(" -- no reply within %u ms\n", w->timeout);
+		return;
+	}
+	reply(" -- reply after %u frames (%.2f ms):", w->rtt, w->rtt * 1000.0 / jack_get_sample_rate(j_client));
+	for (i = 0; i < w->size && i < WAIT_REPLY_MAX; ++i) {
+		reply(" %02X", w->data[i]);
+	}
+	reply("%s\n", w->size > WAIT_REPLY_MAX ? " .." : "");
+}
+
+/**
+ * match the input received so far against the active waits, once
+ * their messages were sent. Until then input that could be a reply
+ * to one of them is kept.
+ */
+static void wait_input(wait_t *const *waits, int n_waits) {
+	event_queue_t *q = &midi_in.queue;
+	const uint8_t *data;
+	jack_nframes_t time = 0;
+	jack_nframes_t keep = 0; // the earliest reply of the waits not sent yet
+	uint32_t head, tail, pos, hdr, len;
+	int k, unsent = 0, consume = 1;
+
+	for (k = 0; k < n_waits; ++k) {
+		wait_t *w = waits[k];
+		if (w->sent || !w->owner) {
+			w->sent = 1;
+			continue;
+		}
+		if ((int32_t)(__atomic_load_n(&owners[w->owner].done, __ATOMIC_ACQUIRE) - w->queued) < 0) {
+			const jack_nframes_t sent = owner_last_sent(w->owner);
+			if (unsent++ == 0 || (int32_t)(sent - keep) < 0) {
+				keep = sent;
+			}
+			continue;
+		}
+		w->sent = 1;
+		w->last_sent = owner_last_sent(w->owner);
+	}
+
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	tail = pos = q->tail;
+	while ((len = queue_peek(q, &pos, head, &hdr, &time, &data)) > 0) {
+		const uint32_t size = hdr >> EV_FLAGBITS;
+		for (k = 0; k < n_waits; ++k) {
+			wait_t *w = waits[k];
+			int i;
+			if (!w->sent || w->found || (int32_t)(time - w->last_sent) < 0) {
+				continue;
+			}
+			for (i = 0; i < w->n && (uint32_t)i < size; ++i) {
+				if (w->pattern[i] >= 0 && w->pattern[i] != data[i]) {
+					break;
+				}
+			}
+			if (i == w->n) {
+				w->found = 1;
+				w->rtt = time - w->last_sent;
+				w->size = size;
+				memcpy(w->data, data, size < WAIT_REPLY_MAX ? size : WAIT_REPLY_MAX);
+			}
+		}
+		if (unsent > 0 && (int32_t)(time - keep) >= 0) {
+			consume = 0; // this and the later ones
+		}
+		pos += len;
+		if (consume) {
+			tail = pos;
+		}
+	}
+	if (consume) {
+		tail = pos; // and the padding
+	}
+	__atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+}
+
+/* nobody waits: drop the input that cannot be a reply, received
+ * before the last message of each client was sent. The rest is kept
+ * for a 'wait' that follows, e.g. in a later packet, while the queue
+ * is less than half full. */
+static void input_expire(void) {
+	event_queue_t *q = &midi_in.queue;
+	const uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	const uint8_t *data;
+	jack_nframes_t time = 0, keep = 0;
+	uint32_t pos = q->tail, hdr, len;
+	int i, n = 0;
+
+	for (i = 1; i < MAX_OWNERS; ++i) {
+		if (owner_claimed[i]) {
+			const jack_nframes_t sent = owner_last_sent(i);
+			if (n++ == 0 || (int32_t)(sent - keep) < 0) {
+				keep = sent;
+			}
+		}
+	}
+	while ((len = queue_peek(q, &pos, head, &hdr, &time, &data)) > 0
+			&& (n == 0 || (int32_t)(time - keep) < 0 || head - pos > q->size / 2)) {
+		pos += len;
+	}
+	__atomic_store_n(&q->tail, pos, __ATOMIC_RELEASE);
+}
+
+/* batch mode, block until the reply or the timeout */
+static void wait_reply(uint32_t timeout, const int16_t *pattern, int n) {
+	wait_t w;
+	wait_t *const waits[1] = { &w };
+
+	wait_start(&w, timeout, pattern, n);
+	pthread_mutex_lock (&queue_lock);
+	while (1) {
+		int64_t left;
+		wait_input(waits, 1);
+		if (wait_done(&w) || (left = ms_until(&w.deadline)) <= 0) {
+			break;
+		}
+		wait_for_process(left);
+	}
+	pthread_mutex_unlock (&queue_lock);
+	wait_stop(&w);
+	wait_report(&w);
+}
+
+/* the control loop's current client, a 'wait' does not block */
+static wait_t *wait_pending = NULL;
+
+/**
+ * parameters of a CmdMidi or CmdSysex command
+ */
+static int lex_midi(lexer_t *lx, const struct parser_cmd *cmd, my_midi_event_t *event, jack_midi_data_t *data) {
+	uint8_t i;
+	if (cmd->type == CmdSysex) {
+		return lex_sysex(lx, event);
+	}
+	event->size = 0;
+	if (cmd->status) {
+		data[event->size++] = cmd->status;
+	}
+	for (i = 0; i < cmd->nparam; ++i) {
+		uint32_t val;
+		const uint32_t max = (i == 0 && !cmd->status) ? 0xff : 0x7f;
+		if (lex_uint(lx, cmd->hex ? 16 : 10, max, &val)) {
+			return -1;
+		}
+		data[event->size++] = val;
+	}
+	event->buffer = data;
+	return 0;
+}
+
+/**
+ * thru rules, control thread
+ */
+static const char *const rule_actions[] = { "drop", "channel", "transpose", "scale", NULL };
+static const char *const rule_types[] = { "any", "note", "polypressure", "cc", "pc", "pressure", "bend", "sys", NULL };
+static const uint8_t rule_type_status[] = { 0, 0x90, 0xa0, 0xb0, 0xc0, 0xd0, 0xe0, 0xf0 };
+
+/* double-buffered tables: wait until process uses the active one,
+ * before the other one is modified */
+static void table_wait(const int *active, const int *in_use) {
+	while (__atomic_load_n(in_use, __ATOMIC_ACQUIRE) != *active && client_state != Exit) {
+		usleep(1000);
+	}
+}
+
+static void table_publish(int *active) {
+	__atomic_store_n(active, *active ^ 1, __ATOMIC_RELEASE);
+}
+
+/* return a copy of the active rule table to modify */
+static rule_table_t *rules_edit(void) {
+	table_wait(&rules_active, &rules_in_use);
+	rule_tables[rules_active ^ 1] = rule_tables[rules_active];
+	return &rule_tables[rules_active ^ 1];
+}
+
+static void rules_publish(void) {
+	table_publish(&rules_active);
+}
+
+static void rules_list(void) {
+	const rule_table_t *t = &rule_tables[rules_active];
+	uint32_t i;
+	if (t->port > 0) {
+		reply(" -- thru to output %u\n", t->port);
+	} else {
+		reply(" -- thru is off\n");
+	}
+	for (i = 0; i < t->n_rules; ++i) {
+		const rule_t *r = &t->rule[i];
+		size_t type;
+		for (type = 0; rule_type_status[type] != r->type; ++type) ;
+		reply(" -- %2u: %s %s ", i + 1, rule_actions[r->action], rule_types[type]);
+		if (r->channels == 0xffff) {
+			reply("* ");
+		} else {
+			reply("%d ", ffs(r->channels));
+		}
+		if (r->lo == 0 && r->hi == 0x7f) {
+			reply("*");
+		} else if (r->lo == r->hi) {
+			reply("%u", r->lo);
+		} else {
+			reply("%u-%u", r->lo, r->hi);
+		}
+		if (r->action != RuleDrop) {
+			reply(r->action == RuleTranspose ? " %+d" : " %d", r->action == RuleChannel ? r->arg + 1 : r->arg);
+		}
+		reply("\n");
+	}
+}
+
+/* returns the index of the word in `words`, or -1 */
+static int lex_keyword(lexer_t *lx, const char *const *words, const char *error) {
+	const char *word;
+	const size_t len = lex_word(lx, &word);
+	int i;
+	for (i = 0; words[i]; ++i) {
+		if (strlen(words[i]) == len && !memcmp(word, words[i], len)) {
+			return i;
+		}
+	}
+	return lex_error(lx, word, error);
+}
+
+/* "<n>", "<lo>-<hi>", or "*" */
+static int lex_range(lexer_t *lx, uint32_t max, uint32_t *lo, uint32_t *hi) {
+	const char *start;
+	lex_space(lx);
+	start = lx->p;
+	if (*lx->p == '*' && lex_is_delim(lx->p[1])) {
+		++lx->p;
+		*lo = 0;
+		*hi = max;
+		return 0;
+	}
+	for (*lo = 0; *lx->p >= '0' && *lx->p <= '9' && *lo <= max; ++lx->p) {
+		*lo = *lo * 10 + (*lx->p - '0');
+	}
+	*hi = *lo;
+	if (*lx->p == '-' && lx->p > start) {
+		const char *digits = ++lx->p;
+		for (*hi = 0; *lx->p >= '0' && *lx->p <= '9' && *hi <= max; ++lx->p) {
+			*hi = *hi * 10 + (*lx->p - '0');
+		}
+		if (lx->p == digits) {
+			return lex_error(lx, start, "invalid range");
+		}
+	}
+	if (lx->p == start || !lex_is_delim(*lx->p)) {
+		return lex_error(lx, start, lex_is_end(*start) ? "missing parameter" : "invalid range");
+	}
+	if (*hi > max || *lo > *hi) {
+		lx->max = max;
+		return lex_error(lx, start, "value out of range");
+	}
+	return 0;
+}
+
+/* "<action> <type> <channel> <range> [<arg>]" */
+static int lex_rule(lexer_t *lx, rule_t *r) {
+	uint32_t lo, hi, val;
+	int action, type;
+	const char *pos;
+
+	if ((action = lex_keyword(lx, rule_actions, "unknown action")) < 0) {
+		return -1;
+	}
+	if ((type = lex_keyword(lx, rule_types, "unknown message type")) < 0) {
+		return -1;
+	}
+	r->action = action;
+	r->type = rule_type_status[type];
+
+	lex_space(lx);
+	pos = lx->p;
+	if (lex_range(lx, 16, &lo, &hi)) {
+		return -1;
+	}
+	if (lo == 0 && hi == 16) {
+		r->channels = 0xffff;
+	} else if (lo == 0 || lo != hi) {
+		lx->max = 0;
+		return lex_error(lx, pos, "channel must be 1..16 or *");
+	} else {
+		r->channels = 1 << (lo - 1);
+	}
+
+	if (lex_range(lx, 0x7f, &lo, &hi)) {
+		return -1;
+	}
+	r->lo = lo;
+	r->hi = hi;
+
+	r->arg = 0;
+	switch (r->action) {
+		case RuleChannel:
+			lex_space(lx);
+			pos = lx->p;
+			if (lex_uint(lx, 10, 16, &val)) {
+				return -1;
+			}
+			if (val == 0) {
+				return lex_error(lx, pos, "channels are numbered from 1");
+			}
+			r->arg = val - 1;
+			break;
+		case RuleTranspose:
+			lex_space(lx);
+			if (*lx->p == '-' || *lx->p == '+') {
+				const int neg = *lx->p++ == '-';
+				if (lex_uint(lx, 10, 127, &val)) {
+					return -1;
+				}
+				r->arg = neg ? -(int)val : (int)val;
+			} else if (lex_uint(lx, 10, 127, &val)) {
+				return -1;
+			} else {
+				r->arg = val;
+			}
+			break;
+		case RuleScale:
+			if (lex_uint(lx, 10, 1000, &val)) {
+				return -1;
+			}
+			r->arg = val;
+			break;
+	}
+	return 0;
+}
+
+/**
+ * macros, control thread
+ */
+static int macro_find(const macro_table_t *t, const char *name, size_t len) {
+	uint32_t i;
+	for (i = 0; i < t->n_macros; ++i) {
+		if (strlen(t->macro[i].name) == len && !memcmp(t->macro[i].name, name, len)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* add or replace a macro, indices of existing macros don't change */
+static const char *macro_store(const char *name, size_t name_len, const uint8_t *block, uint32_t len, uint32_t count) {
+	const macro_table_t *cur = &macro_tables[macros_active];
+	const int index = macro_find(cur, name, name_len);
+	macro_table_t *next = &macro_tables[macros_active ^ 1];
+	uint32_t i, n;
+
+	if (index < 0 && cur->n_macros >= MAX_MACROS) {
+		return "too many macros";
+	}
+	if (cur->used - (index < 0 ? 0 : cur->macro[index].len) + len > MACRO_BYTES) {
+		return "out of macro memory";
+	}
+
+	table_wait(&macros_active, &macros_in_use);
+
+	n = index < 0 ? cur->n_macros + 1 : cur->n_macros;
+	next->used = 0;
+	for (i = 0; i < n; ++i) {
+		macro_t *m = &next->macro[i];
+		if (i == (uint32_t)index || i == cur->n_macros) {
+			memcpy(m->name, name, name_len);
+			m->name[name_len] = '\0';
+			memcpy(&next->data[next->used], block, len);
+			m->len = len;
+			m->count = count;
+		} else {
+			*m = cur->macro[i];
+			memcpy(&next->data[next->used], &cur->data[cur->macro[i].offset], m->len);
+		}
+		m->offset = next->used;
+		next->used += m->len;
+	}
+	next->n_macros = n;
+	table_publish(&macros_active);
+	return NULL;
+}
+
+/**
+ * "<name> <message> [; <message> ..]", messages may be prefixed
+ * with '+<ms>' relative to the time the macro is fired, and a port.
+ */
+static int lex_macro(lexer_t *lx) {
+	static __thread uint8_t *block = NULL;
+	const char *name;
+	const size_t name_len = lex_word(lx, &name);
+	uint32_t len = 0, count = 0;
+	const char *error;
+	char *dup, *p;
+	lexer_t seg;
+
+	if (name_len == 0 || name_len >= MACRO_NAME) {
+		return lex_error(lx, name, name_len ? "name too long" : "missing name");
+	}
+	if (!block && !(block = malloc(MACRO_BYTES))) {
+		return lex_error(lx, name, "out of memory");
+	}
+	if (!(dup = strdup(lx->line))) {
+		return lex_error(lx, name, "out of memory");
+	}
+
+	/* parse each message in a copy of the line, split at ';' */
+	for (p = dup + (lx->p - lx->line); ; ) {
+		char *semi = strchr(p, ';');
+		const struct parser_cmd *cmd;
+		jack_midi_data_t data[3];
+		my_midi_event_t event;
+		jack_nframes_t offset;
+		uint32_t size;
+
+		if (semi) {
+			*semi = '\0';
+		}
+		seg.line = dup;
+		seg.p = p;
+		seg.error = NULL;
+		seg.max = 0;
+
+		lex_space(&seg);
+		if (*seg.p == '@') {
+			lex_error(&seg, seg.p, "only relative timestamps in a macro");
+			goto error;
+		}
+		macro_def = 1;
+		if (lex_timestamp(&seg, &event) || lex_port(&seg, &event)) {
+			macro_def = 0;
+			goto error;
+		}
+		macro_def = 0;
+		if (lex_end(&seg)) {
+			if (event.scheduled || event.port) {
+				lex_error(&seg, seg.p, "missing message");
+				goto error;
+			}
+		} else {
+			if (!(cmd = lex_command(&seg))) {
+				goto error;
+			}
+			if (cmd->type != CmdMidi && cmd->type != CmdSysex) {
+				lex_error(&seg, p, "only MIDI messages in a macro");
+				goto error;
+			}
+			if (lex_midi(&seg, cmd, &event, data)) {
+				goto error;
+			}
+			if (!lex_end(&seg)) {
+				lex_error(&seg, seg.p, "unexpected characters");
+				goto error;
+			}
+			size = event.size;
+			if (len + 1 + sizeof(uint32_t) + varint_len(size) + size > MACRO_BYTES) {
+				lex_error(&seg, p, "macro too long");
+				goto error;
+			}
+			offset = event.scheduled ? event.time : 0;
+			block[len++] = event.port;
+			memcpy(&block[len], &offset, sizeof(uint32_t));
+			len += sizeof(uint32_t);
+			len += varint_write(&block[len], size);
+			memcpy(&block[len], event.buffer, size);
+			len += size;
+			++count;
+		}
+		if (!semi) {
+			break;
+		}
+		p = semi + 1;
+	}
+	free(dup);
+	lx->p += strlen(lx->p);
+
+	if (count == 0) {
+		return lex_error(lx, lx->p, "empty macro");
+	}
+	if ((error = macro_store(name, name_len, block, len, count))) {
+		return lex_error(lx, name, error);
+	}
+	return 0;
+
+error:
+	lx->error = seg.error;
+	lx->error_pos = lx->line + (seg.error_pos - dup);
+	lx->max = seg.max;
+	free(dup);
+	return -1;
+}
+
+/* queue a single control record, that expands to all messages of the macro */
+static int lex_fire(lexer_t *lx, const my_midi_event_t *event) {
+	const macro_table_t *t = &macro_tables[macros_active];
+	const char *name;
+	const size_t name_len = lex_word(lx, &name);
+	const int index = macro_find(t, name, name_len);
+	uint8_t ctl[5];
+
+	if (index < 0) {
+		return lex_error(lx, name, name_len ? "unknown macro" : "missing name");
+	}
+	if (event->port) {
+		return lex_error(lx, lx->line, "macros use the ports given in the definition");
+	}
+	ctl[0] = CtlMacro;
+	ctl[1] = index & 0xff;
+	ctl[2] = index >> 8;
+	ctl[3] = t->macro[index].count & 0xff;
+	ctl[4] = t->macro[index].count >> 8;
+	if (queue_record(0, EV_CONTROL | (event->scheduled ? EV_SCHEDULED : 0), event->time, ctl, sizeof(ctl)) == 0) {
+		queue_count(t->macro[index].count);
+	}
+	return 0;
+}
+
+static void macros_list(void) {
+	const macro_table_t *t = &macro_tables[macros_active];
+	uint32_t i;
+	for (i = 0; i < t->n_macros; ++i) {
+		reply(" -- %s: %u messages, %u bytes\n", t->macro[i].name, t->macro[i].count, t->macro[i].len);
+	}
+	reply(" -- %u of %u bytes used\n", t->used, MACRO_BYTES);
+}
+
+static void metric(const char *name, const char *type, const char *help, double value) {
+	reply("# HELP midicmd_%s %s\n# TYPE midicmd_%s %s\nmidicmd_%s %.9g\n", name, help, name, type, name, value);
+}
+
+/* statistics in Prometheus text exposition format */
+static void print_metrics(void) {
+	const double rate = jack_get_sample_rate(j_client);
+	lat_snapshot_t ls;
+	uint32_t n = 0;
+	uint32_t i;
+
+	metric("queued_total", "counter", "Events queued by the input threads.", __atomic_load_n(&stats.queued, __ATOMIC_RELAXED));
+	metric("generated_total", "counter", "Events generated by clock and patterns.", __atomic_load_n(&stats.generated, __ATOMIC_RELAXED));
+	metric("sent_total", "counter", "Events written to an output port.", __atomic_load_n(&stats.sent, __ATOMIC_RELAXED));
+	metric("late_total", "counter", "Events sent after their due time.", __atomic_load_n(&stats.late, __ATOMIC_RELAXED));
+	metric("queue_full_total", "counter", "Events dropped, the queue was full.", __atomic_load_n(&stats.ring_full, __ATOMIC_RELAXED));
+	metric("dropped_total", "counter", "Events dropped, too large for the port buffer.", __atomic_load_n(&stats.port_dropped, __ATOMIC_RELAXED));
+	metric("deferred_total", "counter", "Events retried next cycle, the port buffer was full.", __atomic_load_n(&stats.port_deferred, __ATOMIC_RELAXED));
+	metric("rate_limited_cycles_total", "counter", "Port cycles that deferred events to the next, over the byte-rate.", __atomic_load_n(&stats.rate_limited, __ATOMIC_RELAXED));
+	metric("budget_limited_cycles_total", "counter", "Port cycles that deferred events to the next, over the per-cycle budget.", __atomic_load_n(&stats.budget_limited, __ATOMIC_RELAXED));
+	metric("xruns_total", "counter", "JACK xruns.", __atomic_load_n(&stats.xruns, __ATOMIC_RELAXED));
+	metric("coalesced_total", "counter", "Events replaced by a later value in the same cycle.", __atomic_load_n(&stats.coalesced, __ATOMIC_RELAXED));
+	metric("wire_bytes_total", "counter", "Bytes sent, with running status.", __atomic_load_n(&stats.wire_bytes, __ATOMIC_RELAXED));
+	metric("received_total", "counter", "Events received on the input port.", __atomic_load_n(&stats.received, __ATOMIC_RELAXED));
+	metric("thru_total", "counter", "Events forwarded from input to output.", __atomic_load_n(&stats.thru, __ATOMIC_RELAXED));
+	metric("cycles_total", "counter", "Process cycles that sent events.", __atomic_load_n(&latency.cycles, __ATOMIC_RELAXED));
+	metric("events_per_cycle_max", "gauge", "Most events sent in a single cycle.", __atomic_load_n(&latency.events_max, __ATOMIC_RELAXED));
+	metric("dsp_load_ratio", "gauge", "JACK DSP load.", jack_cpu_load(j_client) / 100.0);
+
+	/* one bucket per octave, from 16 frames to 2^20 */
+	lat_snapshot(&ls);
+	reply("# HELP midicmd_latency_seconds Time from queueing (or the due time) to sending.\n"
+			"# TYPE midicmd_latency_seconds histogram\n");
+	for (i = 0; i < lat_bucket(1 << 20); ++i) {
+		n += ls.bucket[i];
+		if (i == 15 || (i > 16 && (i - 16) % 8 == 7)) {
+			reply("midicmd_latency_seconds_bucket{le=\"%.9g\"} %u\n", (lat_bucket_max(i) + 1.0) / rate, n);
+		}
+	}
+	reply("midicmd_latency_seconds_bucket{le=\"+Inf\"} %u\n", ls.count);
+	reply("midicmd_latency_seconds_sum %.9g\n", ls.sum / rate);
+	reply("midicmd_latency_seconds_count %u\n", ls.count);
+}
+
+/* queue a generator control record, at the time of the event */
+static void gen_record(const my_midi_event_t *event, const uint8_t *rec, uint32_t len) {
+	queue_record(0, EV_CONTROL | (event->scheduled ? EV_SCHEDULED : 0), event->time, rec, len);
+}
+
+/* "clock start|stop|continue", "clock tempo <bpm>", "clock locate <16ths>" */
+static int lex_clock(lexer_t *lx, const my_midi_event_t *event) {
+	static const char *const ops[] = { "start", "stop", "continue", "tempo", "locate", NULL };
+	uint8_t rec[3 + sizeof(double)];
+	uint32_t len = 3;
+	const int op = lex_keyword(lx, ops, "expected start, stop, continue, tempo or locate");
+
+	if (op < 0) {
+		return -1;
+	}
+	rec[0] = CtlClock;
+	rec[1] = op;
+	rec[2] = event->port;
+
+	if (op == ClockTempo) {
+		const char *start;
+		double bpm, fpt;
+		lex_space(lx);
+		start = lx->p;
+		if (lex_decimal(lx, &bpm)) {
+			return -1;
+		}
+		if (bpm < 1 || bpm > 999) {
+			lx->max = 999;
+			return lex_error(lx, start, "tempo out of range");
+		}
+		fpt = clock_frames_per_tick(bpm);
+		memcpy(&rec[3], &fpt, sizeof(double));
+		len += sizeof(double);
+	} else if (op == ClockLocate) {
+		uint32_t pos;
+		if (lex_uint(lx, 10, 16383, &pos)) {
+			return -1;
+		}
+		rec[3] = pos & 0x7f;
+		rec[4] = pos >> 7;
+		len += 2;
+	}
+	gen_record(event, rec, len);
+	return 0;
+}
+
+/* "pattern <slot> <ticks> <macro|-> [..]", "pattern <slot> off" */
+static int lex_steps(lexer_t *lx, const my_midi_event_t *event) {
+	const macro_table_t *t = &macro_tables[macros_active];
+	uint8_t rec[5 + 2 * PATTERN_STEPS];
+	uint32_t slot, ticks = 0, n = 0;
+
+	if (event->port) {
+		return lex_error(lx, lx->line, "macros use the ports given in the definition");
+	}
+	if (lex_uint(lx, 10, MAX_PATTERNS, &slot)) {
+		return -1;
+	}
+	if (slot == 0) {
+		lx->max = MAX_PATTERNS;
+		return lex_error(lx, lx->p - 1, "value out of range");
+	}
+	lex_space(lx);
+	if (!strncmp(lx->p, "off", 3) && lex_is_delim(lx->p[3])) {
+		lx->p += 3;
+	} else {
+		if (lex_uint(lx, 10, 65535, &ticks)) {
+			return -1;
+		}
+		if (ticks == 0) {
+			lx->max = 65535;
+			return lex_error(lx, lx->p - 1, "value out of range");
+		}
+		while (!lex_end(lx)) {
+			const char *name;
+			const size_t name_len = lex_word(lx, &name);
+			int index;
+			if (n == PATTERN_STEPS) {
+				return lex_error(lx, name, "too many steps");
+			}
+			if (name_len == 1 && name[0] == '-') {
+				index = NO_MACRO;
+			} else if ((index = macro_find(t, name, name_len)) < 0) {
+				return lex_error(lx, name, "unknown macro");
+			}
+			rec[5 + 2 * n] = index & 0xff;
+			rec[6 + 2 * n] = index >> 8;
+			++n;
+		}
+		if (n == 0) {
+			return lex_error(lx, lx->p, "missing steps");
+		}
+	}
+	rec[0] = CtlPattern;
+	rec[1] = slot - 1;
+	rec[2] = ticks & 0xff;
+	rec[3] = ticks >> 8;
+	rec[4] = n;
+	gen_record(event, rec, 5 + 2 * n);
+	return 0;
+}
+
+static unsigned int input_line = 0; // batch mode, for error messages
+
+/* connect <jack-port>, the rest of the line; JACK port names may contain spaces */
+static int lex_connect(lexer_t *lx, const my_midi_event_t *event) {
+	char name[320]; // JACK_CLIENT_NAME_SIZE + JACK_PORT_NAME_SIZE
+	const char *end;
+	size_t n;
+
+	lex_space(lx);
+	for (end = lx->p; !lex_is_end(*end); ++end) ;
+	while (end > lx->p && (end[-1] == ' ' || end[-1] == '\t')) {
+		--end;
+	}
+	n = end - lx->p;
+	if (n == 0) {
+		return lex_error(lx, lx->p, "missing port name");
+	}
+	if (n >= sizeof(name)) {
+		return lex_error(lx, lx->p, "port name too long");
+	}
+	memcpy(name, lx->p, n);
+	name[n] = '\0';
+	if (jack_connect(j_client, jack_port_name(outs[event->port].port), name)) {
+		return lex_error(lx, lx->p, "cannot connect port");
+	}
+	lx->p = end;
+	return 0;
+}
+
+static int parse_message(const char *msg) {
+	lexer_t lx = { msg, msg, NULL, NULL, 0 };
+	const struct parser_cmd *cmd;
+	my_midi_event_t event;
+	int16_t pattern[WAIT_PATTERN];
+	rule_t rule;
+	uint32_t timeout, port;
+	double sec;
+	int n;
+
+	if (lex_timestamp(&lx, &event) || lex_port(&lx, &event)) {
+		goto error;
+	}
+	if (lex_end(&lx)) {
+		if (event.scheduled || event.port) {
+			lex_error(&lx, lx.p, "missing message");
+			goto error;
+		}
+		return 0; // empty line or comment
+	}
+	if (!(cmd = lex_command(&lx))) {
+		goto error;
+	}
+
+	switch (cmd->type) {
+		case CmdExit:
+			client_state = Exit;
+			break;
+		case CmdReconnect:
+			return 1;
+		case CmdConnect:
+			if (lex_connect(&lx, &event)) {
+				goto error;
+			}
+			break;
+		case CmdHelp:
+			print_help();
+			break;
+		case CmdStats:
+			{
+				char buf[1024];
+				format_stats(buf, sizeof(buf));
+				reply("%s", buf);
+			}
+			break;
+		case CmdPlay:
+			jack_transport_start(j_client);
+			break;
+		case CmdStop:
+			jack_transport_stop(j_client);
+			break;
+		case CmdLocate:
+			lex_space(&lx);
+			if (lex_decimal(&lx, &sec)) {
+				goto error;
+			}
+			if (sec * jack_get_sample_rate(j_client) >= UINT32_MAX) {
+				lex_error(&lx, lx.p, "position out of range");
+				goto error;
+			}
+			jack_transport_locate(j_client, rint(sec * jack_get_sample_rate(j_client)));
+			break;
+		case CmdWait:
+			if (lex_pattern(&lx, &timeout, pattern, &n)) {
+				goto error;
+			}
+			if (!midi_in.enabled) {
+				lex_error(&lx, lx.line, "no input port, see --input");
+				goto error;
+			}
+			if (wait_pending) {
+				wait_start(wait_pending, timeout, pattern, n);
+			} else {
+				wait_reply(timeout, pattern, n);
+			}
+			break;
+		case CmdThru:
+			if (lex_uint(&lx, 10, n_outs, &port)) {
+				goto error;
+			}
+			if (!midi_in.enabled) {
+				lex_error(&lx, lx.line, "no input port, see --input");
+				goto error;
+			}
+			rules_edit()->port = port;
+			rules_publish();
+			break;
+		case CmdRule:
+			if (!midi_in.enabled) {
+				lex_error(&lx, lx.line, "no input port, see --input");
+				goto error;
+			}
+			lex_space(&lx);
+			if (!strncmp(lx.p, "clear", 5) && lex_is_delim(lx.p[5])) {
+				lx.p += 5;
+				rules_edit()->n_rules = 0;
+				rules_publish();
+			} else if (lex_rule(&lx, &rule)) {
+				goto error;
+			} else if (!lex_end(&lx)) {
+				break; // reported below
+			} else if (rule_tables[rules_active].n_rules >= MAX_RULES) {
+				lex_error(&lx, lx.line, "too many rules");
+				goto error;
+			} else {
+				rule_table_t *t = rules_edit();
+				t->rule[t->n_rules++] = rule;
+				rules_publish();
+			}
+			break;
+		case CmdRules:
+			rules_list();
+			break;
+		case CmdMacro:
+			if (lex_macro(&lx)) {
+				goto error;
+			}
+			break;
+		case CmdFire:
+			if (lex_fire(&lx, &event)) {
+				goto error;
+			}
+			break;
+		case CmdMacros:
+			macros_list();
+			break;
+		case CmdMetrics:
+			print_metrics();
+			break;
+		case CmdClock:
+			if (lex_clock(&lx, &event)) {
+				goto error;
+			}
+			break;
+		case CmdPattern:
+			if (lex_steps(&lx, &event)) {
+				goto error;
+			}
+			break;
+		case CmdSysex:
+		case CmdMidi:
+			if (cmd->encode(&lx, &event)) {
+				goto error;
+			}
+			return 0;
+	}
+
+	if (!lex_end(&lx)) {
+		lex_error(&lx, lx.p, "unexpected characters");
+		goto error;
+	}
+	return 0;
+
+error:
+	if (input_line > 0) {
+		reply(" -- line %u, ", input_line);
+	} else {
+		reply(" -- ");
+	}
+	reply("column %d: %s", (int)(lx.error_pos - lx.line) + 1, lx.error);
+	if (lx.max > 0) {
+		reply(" (0..%u)", lx.max);
+	}
+	reply("\n");
+	return 0;
+}
+
+/* input line buffer, room for a max. size SysEx message in hex */
+static char *line_buf = NULL;
+static size_t line_len = 0;
+
+/**
+ * batch mode, parse text line by line.
+ * returns the number of bytes consumed, an incomplete last line
+ * is kept for the next call unless `eof` is set.
+ */
+static size_t batch_text(const char *data, size_t len, int eof) {
+	const char *end = data + len;
+	const char *pos = data;
+
+	if (!eof) {
+		while (end > data && end[-1] != '\n') {
+			--end;
+		}
+	}
+
+	while (pos < end && client_state != Exit) {
+		const char *eol = memchr(pos, '\n', end - pos);
+		size_t n = eol ? (size_t)(eol - pos) : (size_t)(end - pos);
+		++input_line;
+		if (n >= line_len) {
+			reply(" -- line %u: too long, ignored\n", input_line);
+		} else {
+			memcpy(line_buf, pos, n);
+			line_buf[n] = '\0';
+			if (parse_message(line_buf) == 1) {
+				connect_ports();
+			}
+		}
+		pos += n + 1;
+	}
+	return pos > end ? len : (size_t)(pos - data);
+}
+
+static struct {
+	uint8_t status;       // running status
+	uint8_t port;         // see capture_port()
+	jack_nframes_t time;  // relative to batch_start
+	unsigned int skipped; // invalid bytes
+} binary_in;
+
+/* length of a MIDI message, -1 for sysex */
+static int midi_message_size(uint8_t status) {
+	return status == 0xf0 ? -1 : MIDI_STATUS_SIZE(status);
+}
+
+/**
+ * batch mode, parse a binary MIDI byte-stream with optional
+ * delta-times. Complete messages are queued directly from the
+ * input buffer, except for running status which needs the
+ * status byte to be prepended.
+ *
+ * returns the number of bytes consumed, an incomplete last message
+ * is kept for the next call unless `eof` is set.
+ */
+static size_t batch_binary(const char *buf, size_t len, int eof) {
+	const uint8_t *data = (const uint8_t*) buf;
+	size_t pos = 0;
+
+	while (pos < len && client_state != Exit) {
+		const size_t start = pos;
+		jack_midi_data_t running[3];
+		my_midi_event_t event;
+		uint32_t delta = 0;
+		size_t size; // message size
+		size_t used; // bytes of input
+		size_t i;
+
+		if (binary_mode == BinaryTimed) {
+			/* variable-length quantity as in SMF, max 4 bytes */
+			for (i = 0; pos < len && i < 4; ++i) {
+				delta = (delta << 7) | (data[pos] & 0x7f);
+				if (!(data[pos++] & 0x80)) {
+					break;
+				}
+			}
+			if (i == 4) {
+				++binary_in.skipped;
+				continue;
+			}
+			if (pos >= len) {
+				pos = start; // incomplete
+				break;
+			}
+		}
+
+		if (data[pos] == 0xf0) {
+			for (i = 1; pos + i < len && data[pos + i] < 0x80; ++i) ;
+			if (pos + i >= len) {
+				pos = start; // incomplete
+				break;
+			}
+			binary_in.status = 0;
+			if (data[pos + i] != 0xf7 || i + 1 > (size_t)max_sysex) {
+				/* unterminated or too long, skip it */
+				binary_in.skipped += i;
+				pos += i;
+				continue;
+			}
+			size = used = i + 1;
+			event.buffer = &data[pos];
+		}
+		else if (data[pos] == 0xf5) {
+			/* port select, as written by --record */
+			if (pos + 1 >= len) {
+				pos = start; // incomplete
+				break;
+			}
+			binary_in.status = 0;
+			binary_in.time += delta;
+			if (data[pos + 1] < n_outs) {
+				binary_in.port = data[pos + 1];
+			} else {
+				binary_in.skipped += 2;
+			}
+			pos += 2;
+			continue;
+		}
+		else if (data[pos] & 0x80) {
+			size = used = midi_message_size(data[pos]);
+			event.buffer = &data[pos];
+			if (data[pos] < 0xf0) {
+				binary_in.status = data[pos];
+			} else if (data[pos] < 0xf8) {
+				binary_in.status = 0;
+			}
+		}
+		else if (binary_in.status) {
+			/* running status, the status byte is not part of the input */
+			size = midi_message_size(binary_in.status);
+			used = size - 1;
+			running[0] = binary_in.status;
+			if (pos + used <= len) {
+				memcpy(&running[1], &data[pos], used);
+			}
+			event.buffer = running;
+		}
+		else {
+			++binary_in.skipped;
+			++pos;
+			continue;
+		}
+
+		if (pos + used > len) {
+			pos = start; // incomplete
+			break;
+		}
+		if (event.buffer[0] != 0xf0) {
+			for (i = 1; i < size && !(event.buffer[i] & 0x80); ++i) ;
+			if (i < size) {
+				/* status byte where data was expected, resync */
+				binary_in.skipped += i - (size - used);
+				pos += i - (size - used);
+				continue;
+			}
+		}
+
+		binary_in.time += delta;
+		event.time = batch_start + binary_in.time;
+		event.scheduled = binary_mode == BinaryTimed;
+		event.port = binary_in.port;
+		event.size = size;
+		queue_event(&event);
+		pos += used;
+	}
+
+	if (eof && pos < len) {
+		binary_in.skipped += len - pos;
+		pos = len;
+	}
+	return pos;
+}
+
+/**
+ * batch mode, read and parse all input from fd.
+ * regular files are memory mapped, pipes are read in large chunks.
+ * With `lines` the input is text, see batch_text().
+ */
+static void batch_read(int fd, size_t (*parse)(const char *, size_t, int), int lines) {
+	const size_t chunk = 1048576 + line_len;
+	size_t have = 0;
+	int discard = 0; // the rest of a line that is too long
+	char *data;
+
+#ifndef WIN32
+	struct stat st;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			parse(map, st.st_size, 1);
+			munmap(map, st.st_size);
+			return;
+		}
+	}
+#endif
+
+	if (!(data = malloc(chunk))) {
+		fprintf(stderr, "out of memory\n");
+		return;
+	}
+	while (client_state != Exit) {
+		ssize_t n = read(fd, data + have, chunk - have);
+		size_t done;
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		have += n;
+		if (discard) {
+			const char *eol = memchr(data, '\n', have);
+			if (!eol) {
+				have = 0;
+				continue;
+			}
+			done = eol + 1 - data;
+			memmove(data, data + done, have - done);
+			have -= done;
+			discard = 0;
+		}
+		/* parse complete lines or messages, keep the remainder.
+		 * If a full buffer holds none, a line is ignored up to its end,
+		 * binary data is forced through as if at EOF */
+		done = parse(data, have, 0);
+		if (done == 0 && have == chunk) {
+			if (lines) {
+				reply(" -- line %u: too long, ignored\n", ++input_line);
+				discard = 1;
+				done = have;
+			} else {
+				done = parse(data, have, 1);
+			}
+		}
+		memmove(data, data + done, have - done);
+		have -= done;
+	}
+	if (have > 0) {
+		parse(data, have, 1);
+	}
+	free(data);
+}
+
+/**
+ * batch mode, wait until all queued events have been sent
+ */
+static void batch_drain(void) {
+	pthread_mutex_lock (&queue_lock);
+	while (client_state != Exit && (!all_sent() || __atomic_load_n(&gen.running, __ATOMIC_RELAXED))) {
+		wait_for_process(100); // re-check client_state
+	}
+	pthread_mutex_unlock (&queue_lock);
+}
+
+/**
+ * Standard MIDI File loader
+ */
+typedef struct {
+	uint64_t tick;
+	uint32_t seq;    // order in the file
+	uint32_t size;   // including the status byte
+	uint32_t offset; // of the data following the status byte, in the file
+	uint8_t status;  // 0: escaped data (F7), no status byte
+} smf_tmp_event_t;
+
+typedef struct {
+	uint64_t tick;
+	uint32_t seq;
+	uint32_t usec_per_beat;
+} smf_tempo_t;
+
+static int smf_tmp_cmp(const void *a, const void *b) {
+	const smf_tmp_event_t *ea = a;
+	const smf_tmp_event_t *eb = b;
+	if (ea->tick != eb->tick) {
+		return ea->tick < eb->tick ? -1 : 1;
+	}
+	return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+static int smf_tempo_cmp(const void *a, const void *b) {
+	const smf_tempo_t *ta = a;
+	const smf_tempo_t *tb = b;
+	if (ta->tick != tb->tick) {
+		return ta->tick < tb->tick ? -1 : 1;
+	}
+	return ta->seq < tb->seq ? -1 : ta->seq > tb->seq;
+}
+
+/* SMF variable-length quantity, returns -1 on error */
+static int smf_vlq(const uint8_t **p, const uint8_t *end, uint32_t *val) {
+	int i;
+	*val = 0;
+	for (i = 0; i < 4 && *p < end; ++i) {
+		const uint8_t b = *(*p)++;
+		*val = (*val << 7) | (b & 0x7f);
+		if (!(b & 0x80)) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static uint32_t smf_be(const uint8_t *p, int bytes) {
+	uint32_t v = 0;
+	while (bytes-- > 0) {
+		v = (v << 8) | *p++;
+	}
+	return v;
+}
+
+static void *smf_grow(void *ptr, uint32_t *alloc, uint32_t used, size_t elsize) {
+	void *tmp;
+	if (used < *alloc) {
+		return ptr;
+	}
+	tmp = realloc(ptr, (*alloc + 1024) * elsize);
+	if (!tmp) {
+		free(ptr);
+		return NULL;
+	}
+	*alloc += 1024;
+	return tmp;
+}
+
+/* parse one MTrk chunk, append events and tempo changes */
+static int smf_parse_track(const uint8_t *file, const uint8_t *p, const uint8_t *end,
+		smf_tmp_event_t **ev, uint32_t *n_ev, uint32_t *a_ev,
+		smf_tempo_t **tempo, uint32_t *n_tempo, uint32_t *a_tempo,
+		uint32_t *seq) {
+	uint64_t tick = 0;
+	uint8_t running = 0;
+
+	while (p < end) {
+		uint32_t delta, len;
+		uint32_t size;
+		uint8_t status;
+
+		if (smf_vlq(&p, end, &delta) || p >= end) {
+			return -1;
+		}
+		tick += delta;
+
+		if (*p & 0x80) {
+			status = *p++;
+		} else if (running) {
+			status = running;
+		} else {
+			return -1;
+		}
+
+		if (status == 0xff) {
+			/* meta event */
+			uint8_t type;
+			if (p >= end) {
+				return -1;
+			}
+			type = *p++;
+			if (smf_vlq(&p, end, &len) || len > (uint32_t)(end - p)) {
+				return -1;
+			}
+			running = 0;
+			if (type == 0x2f) {
+				return 0; // end of track
+			}
+			if (type == 0x51 && len == 3) {
+				if (!(*tempo = smf_grow(*tempo, a_tempo, *n_tempo, sizeof(smf_tempo_t)))) {
+					return -1;
+				}
+				(*tempo)[*n_tempo].tick = tick;
+				(*tempo)[*n_tempo].seq = (*seq)++;
+				(*tempo)[*n_tempo].usec_per_beat = smf_be(p, 3);
+				++*n_tempo;
+			}
+			p += len;
+			continue;
+		}
+
+		if (status == 0xf0 || status == 0xf7) {
+			/* sysex, or escaped data (F7) */
+			if (smf_vlq(&p, end, &len) || len > (uint32_t)(end - p)) {
+				return -1;
+			}
+			running = 0;
+			size = len;
+			if (status == 0xf0) {
+				++size;
+			} else {
+				status = 0;
+			}
+			p += len;
+			if (size == 0 || size > (uint32_t)max_sysex) {
+				continue;
+			}
+		} else if (status < 0xf0) {
+			/* channel message */
+			size = midi_message_size(status);
+			if (size - 1 > (uint32_t)(end - p)) {
+				return -1;
+			}
+			running = status;
+			p += size - 1;
+		} else {
+			return -1; // not valid in a file
+		}
+
+		if (!(*ev = smf_grow(*ev, a_ev, *n_ev, sizeof(smf_tmp_event_t)))) {
+			return -1;
+		}
+		(*ev)[*n_ev].tick = tick;
+		(*ev)[*n_ev].seq = (*seq)++;
+		(*ev)[*n_ev].size = size;
+		(*ev)[*n_ev].status = status;
+		(*ev)[*n_ev].offset = (p - file) - (size - (status ? 1 : 0));
+		++*n_ev;
+	}
+	return 0;
+}
+
+static int smf_load(const char *path, jack_nframes_t rate) {
+	smf_tmp_event_t *ev = NULL;
+	smf_tempo_t *tempo = NULL;
+	uint32_t n_ev = 0, a_ev = 0, n_tempo = 0, a_tempo = 0;
+	uint32_t seq = 0, t, i;
+	uint8_t *file = NULL;
+	size_t file_len = 0;
+	size_t data_len = 0;
+	const uint8_t *p, *end;
+	uint32_t format, ntracks, division;
+	double sec = 0, sec_per_tick;
+	uint64_t tick = 0;
+	int rv = -1;
+	FILE *f;
+
+	if (!(f = fopen(path, "rb"))) {
+		fprintf(stderr, "Cannot open MIDI file '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	while (1) {
+		uint8_t *tmp = realloc(file, file_len + 65536);
+		size_t n;
+		if (!tmp) {
+			break;
+		}
+		file = tmp;
+		n = fread(file + file_len, 1, 65536, f);
+		file_len += n;
+		if (n < 65536) {
+			break;
+		}
+	}
+	fclose(f);
+
+	if (!file || file_len < 14 || memcmp(file, "MThd", 4) || smf_be(file + 4, 4) < 6) {
+		fprintf(stderr, "'%s' is not a standard MIDI file\n", path);
+		goto out;
+	}
+	format = smf_be(file + 8, 2);
+	ntracks = smf_be(file + 10, 2);
+	division = smf_be(file + 12, 2);
+	if (format > 1 || division == 0) {
+		fprintf(stderr, "Unsupported MIDI file '%s' (format %u)\n", path, format);
+		goto out;
+	}
+
+	end = file + file_len;
+	p = file + 8 + smf_be(file + 4, 4);
+
+	for (t = 0; t < ntracks && p <= end - 8; ) {
+		const uint8_t *chunk = p + 8;
+		uint32_t chunk_len = smf_be(p + 4, 4);
+		if (chunk_len > (size_t)(end - chunk)) {
+			chunk_len = end - chunk;
+		}
+		if (!memcmp(p, "MTrk", 4)) {
+			if (smf_parse_track(file, chunk, chunk + chunk_len, &ev, &n_ev, &a_ev, &tempo, &n_tempo, &a_tempo, &seq)) {
+				if (!ev || (n_tempo > 0 && !tempo)) {
+					fprintf(stderr, "Out of memory loading '%s'\n", path);
+					goto out;
+				}
+				fprintf(stderr, "Warning: MIDI file '%s', track %u is truncated or corrupt\n", path, t + 1);
+			}
+			++t;
+		}
+		p = chunk + chunk_len;
+	}
+
+	if (n_ev == 0) {
+		fprintf(stderr, "MIDI file '%s' contains no events\n", path);
+		goto out;
+	}
+
+	/* merge tracks; events at the same tick keep file order */
+	qsort(ev, n_ev, sizeof(smf_tmp_event_t), smf_tmp_cmp);
+	if (n_tempo > 0) {
+		qsort(tempo, n_tempo, sizeof(smf_tempo_t), smf_tempo_cmp);
+	}
+
+	for (i = 0; i < n_ev; ++i) {
+		data_len += ev[i].size;
+	}
+
+	smf.events = alloc_locked(n_ev * sizeof(smf_event_t));
+	smf.data = alloc_locked(data_len);
+	if (!smf.events || !smf.data) {
+		fprintf(stderr, "Out of memory loading '%s'\n", path);
+		goto out;
+	}
+
+	if (division & 0x8000) {
+		/* SMPTE: frames per second (29: 29.97 drop-frame) and ticks per frame */
+		const int fps = -(int8_t)(division >> 8);
+		sec_per_tick = 1.0 / ((fps == 29 ? 29.97 : fps) * (division & 0xff));
+		n_tempo = 0; // tempo does not apply
+	} else {
+		sec_per_tick = 0.5 / division; // 120 BPM until the first tempo change
+	}
+
+	/* convert ticks to audio frames, store data in playback order */
+	data_len = 0;
+	for (i = 0, t = 0; i < n_ev; ++i) {
+		const smf_tmp_event_t *e = &ev[i];
+		jack_midi_data_t *d = &smf.data[data_len];
+		while (t < n_tempo && tempo[t].tick <= e->tick) {
+			sec += (tempo[t].tick - tick) * sec_per_tick;
+			tick = tempo[t].tick;
+			sec_per_tick = tempo[t].usec_per_beat * 1e-6 / division;
+			++t;
+		}
+		smf.events[i].frame = rint((sec + (e->tick - tick) * sec_per_tick) * rate);
+		smf.events[i].size = e->size;
+		smf.events[i].data = data_len;
+		if (e->status) {
+			*d++ = e->status;
+			memcpy(d, &file[e->offset], e->size - 1);
+		} else {
+			memcpy(d, &file[e->offset], e->size);
+		}
+		if (e->status >= 0x80 && e->status < 0xf0) {
+			smf.channels |= 1 << (e->status & 0x0f);
+		}
+		data_len += e->size;
+	}
+	smf.n_events = n_ev;
+	rv = 0;
+
+out:
+	if (rv) {
+		free(smf.events);
+		free(smf.data);
+		smf.events = NULL;
+		smf.data = NULL;
+	}
+	free(ev);
+	free(tempo);
+	free(file);
+	return rv;
+}
+
+/**
+ * Open Sound Control input, decoded straight into MIDI events.
+ *
+ *   /midi/note <ch> <note> <velocity>     (also /midi/noteon)
+ *   /midi/noteoff <ch> <note> <velocity>
+ *   /midi/polypressure <ch> <note> <value>
+ *   /midi/cc <ch> <control> <value>
+ *   /midi/pc <ch> <program>
+ *   /midi/pressure <ch> <value>
+ *   /midi/pitchbend <ch> <value>          14 bit, 8192 is center
+ *   /midi/raw <blob or MIDI message>      any complete message, incl. SysEx
+ *
+ * Channels are 1..16, numeric arguments may be int32 or float.
+ * Bundle timetags are mapped to jack frame-time.
+ */
+static const struct osc_cmd {
+	const char *path;
+	uint8_t status; // 0: raw
+	uint8_t nparam; // data bytes after the channel
+} osc_cmds[] = {
+	{ "/midi/note",         0x90, 2 },
+	{ "/midi/noteon",       0x90, 2 },
+	{ "/midi/noteoff",      0x80, 2 },
+	{ "/midi/polypressure", 0xa0, 2 },
+	{ "/midi/cc",           0xb0, 2 },
+	{ "/midi/pc",           0xc0, 1 },
+	{ "/midi/pressure",     0xd0, 1 },
+	{ "/midi/pitchbend",    0xe0, 2 },
+	{ "/midi/raw",          0,    0 },
+};
+
+static unsigned int osc_invalid = 0; // messages that were ignored, by all OSC threads
+
+typedef struct {
+	const uint8_t *p;
+	const uint8_t *end;
+	const char *tags; // remaining type tags
+} osc_reader_t;
+
+static uint32_t osc_be32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t osc_be64(const uint8_t *p) {
+	return ((uint64_t)osc_be32(p) << 32) | osc_be32(p + 4);
+}
+
+/* nul terminated, padded to 4 bytes */
+static const char *osc_string(const uint8_t **p, const uint8_t *end) {
+	const char *s = (const char *)*p;
+	const uint8_t *nul = memchr(*p, '\0', end - *p);
+	if (!nul) {
+		return NULL;
+	}
+	*p += ((nul - *p) + 4) & ~3;
+	return *p > end ? NULL : s;
+}
+
+static int osc_int(osc_reader_t *r, int32_t *val) {
+	union { uint32_t i; float f; } u32;
+	union { uint64_t i; double d; } u64;
+	const size_t avail = r->end - r->p;
+
+	switch (*r->tags++) {
+		case 'i':
+			if (avail < 4) return -1;
+			*val = (int32_t)osc_be32(r->p);
+			r->p += 4;
+			return 0;
+		case 'f':
+			if (avail < 4) return -1;
+			u32.i = osc_be32(r->p);
+			*val = lrintf(u32.f);
+			r->p += 4;
+			return 0;
+		case 'h':
+			if (avail < 8) return -1;
+			*val = (int32_t)osc_be64(r->p);
+			r->p += 8;
+			return 0;
+		case 'd':
+			if (avail < 8) return -1;
+			u64.i = osc_be64(r->p);
+			*val = lrint(u64.d);
+			r->p += 8;
+			return 0;
+		case 'T':
+			*val = 1;
+			return 0;
+		case 'F':
+			*val = 0;
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/* raw MIDI data, either a blob or a 4 byte MIDI message (port, status, data1, data2) */
+static int osc_data(osc_reader_t *r, const uint8_t **data, uint32_t *size) {
+	const size_t avail = r->end - r->p;
+	uint32_t len;
+	int msize;
+
+	switch (*r->tags++) {
+		case 'b':
+			if (avail < 4 || (len = osc_be32(r->p)) > avail - 4) return -1;
+			*data = r->p + 4;
+			*size = len;
+			r->p += 4 + ((len + 3) & ~3);
+			return r->p > r->end ? -1 : 0;
+		case 'm':
+			if (avail < 4 || (msize = midi_message_size(r->p[1])) < 0) return -1;
+			*data = r->p + 1;
+			*size = msize;
+			r->p += 4;
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+static int osc_message(const uint8_t *p, const uint8_t *end, const my_midi_event_t *tmpl) {
+	jack_midi_data_t msg[3];
+	my_midi_event_t event = *tmpl;
+	const struct osc_cmd *cmd = NULL;
+	osc_reader_t r;
+	const char *path;
+	int32_t ch, val;
+	size_t i;
+
+	if (!(path = osc_string(&p, end))) {
+		return -1;
+	}
+	for (i = 0; i < sizeof(osc_cmds) / sizeof(osc_cmds[0]); ++i) {
+		if (!strcmp(path, osc_cmds[i].path)) {
+			cmd = &osc_cmds[i];
+			break;
+		}
+	}
+	if (!cmd || p >= end || *p != ',' || !(r.tags = osc_string(&p, end))) {
+		return -1;
+	}
+	++r.tags; // ','
+	r.p = p;
+	r.end = end;
+
+	if (cmd->status == 0) {
+		uint32_t size;
+		const uint8_t *data;
+		if (*r.tags == 'm' && r.p < end) {
+			/* the MIDI message's port-id selects the output */
+			if (r.p[0] >= n_outs) {
+				return -1;
+			}
+			event.port = r.p[0];
+		}
+		if (osc_data(&r, &data, &size) || size == 0 || size > (uint32_t)max_sysex || !(data[0] & 0x80)) {
+			return -1;
+		}
+		if (data[0] == 0xf0 ? data[size - 1] != 0xf7 : (int)size != midi_message_size(data[0])) {
+			return -1;
+		}
+		event.buffer = data;
+		event.size = size;
+		return queue_event(&event);
+	}
+
+	if (osc_int(&r, &ch) || ch < 1 || ch > 16) {
+		return -1;
+	}
+	msg[0] = cmd->status | (ch - 1);
+	if (cmd->status == 0xe0) {
+		if (osc_int(&r, &val) || val < 0 || val > 0x3fff) {
+			return -1;
+		}
+		msg[1] = val & 0x7f;
+		msg[2] = val >> 7;
+	} else {
+		for (i = 0; i < cmd->nparam; ++i) {
+			if (osc_int(&r, &val) || val < 0 || val > 0x7f) {
+				return -1;
+			}
+			msg[1 + i] = val;
+		}
+	}
+	event.buffer = msg;
+	event.size = 1 + cmd->nparam;
+	return queue_event(&event);
+}
+
+/* NTP time, seconds since 1900 as 32.32 fixed point */
+static void osc_timetag(uint64_t tt, my_midi_event_t *event) {
+	struct timespec now;
+	jack_nframes_t frame_now;
+	double dt;
+
+	event->scheduled = 0;
+	if (tt == 1) {
+		return; // immediately
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	frame_now = jack_frame_time(j_client);
+	dt = ((double)(tt >> 32) - 2208988800.0 - now.tv_sec)
+		+ (tt & 0xffffffff) / 4294967296.0 - now.tv_nsec * 1e-9;
+	if (dt > 0) {
+		event->time = frame_now + rint(dt * jack_get_sample_rate(j_client));
+		event->scheduled = 1;
+	}
+}
+
+static void osc_packet(const uint8_t *p, size_t len, const my_midi_event_t *tmpl, int depth) {
+	const uint8_t *end = p + len;
+	my_midi_event_t event = *tmpl;
+
+	if (len < 8 || len & 3) {
+		__atomic_fetch_add(&osc_invalid, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (memcmp(p, "#bundle", 8)) {
+		if (osc_message(p, end, tmpl)) {
+			__atomic_fetch_add(&osc_invalid, 1, __ATOMIC_RELAXED);
+		}
+		return;
+	}
+	if (len < 16 || depth > 8) {
+		__atomic_fetch_add(&osc_invalid, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	osc_timetag(osc_be64(p + 8), &event);
+	for (p += 16; p + 4 <= end; ) {
+		const uint32_t size = osc_be32(p);
+		if (size > (size_t)(end - p - 4)) {
+			__atomic_fetch_add(&osc_invalid, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		osc_packet(p + 4, size, &event, depth + 1);
+		p += 4 + size;
+	}
+}
+
+/* one datagram, all its events are queued at once */
+static void osc_input(const uint8_t *buf, size_t len) {
+	my_midi_event_t event;
+	event.time = 0;
+	event.scheduled = 0;
+	event.port = 0;
+	queue_begin();
+	osc_packet(buf, len, &event, 0);
+	queue_commit();
+}
+
+/**
+ * control sockets and interactive input
+ */
+#define MAX_CLIENTS (64)
+
+static struct listener {
+	int fd;
+	int type;         // SOCK_STREAM or SOCK_DGRAM
+	int osc;          // dgram: Open Sound Control
+	const char *path; // unix socket, removed on exit
+	uint8_t owner;    // dgram: of all datagrams, see client_owner()
+	pthread_t thread; // osc: see osc_thread()
+} listeners[MAX_LISTEN];
+static int n_listeners = 0;
+static int n_osc = 0;       // listeners with a thread
+static int osc_running = 0;
+
+/* connected stream clients, fifos and stdin.
+ * A datagram with a 'wait' adds one with fd -1, for the rest of it. */
+static struct client {
+	int fd;
+	int fifo;  // no replies, kept open
+	char *buf; // incomplete line
+	size_t len;
+	wait_t wait;                  // pending, input is paused
+	uint8_t owner;                // see client_owner(), a datagram's is the listener's
+	int reply_fd;                 // see reply_to
+	int dgram;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+} clients[MAX_CLIENTS];
+static int n_clients = 0;
+
+static int add_client(int fd);
+
+/* "unix:<path>", "udp:[host:]port", "tcp:[host:]port", "osc:[host:]port"
+ * or "fifo:<path>" */
+static int listen_on(const char *spec) {
+	struct listener *l = &listeners[n_listeners];
+	int stream;
+	const int one = 1;
+
+	if (n_listeners >= MAX_LISTEN) {
+		fprintf(stderr, "too many listening sockets\n");
+		return -1;
+	}
+
+	if (!strncmp(spec, "fifo:", 5)) {
+		/* a client, the listener only removes a fifo that was created */
+		const char *path = spec + 5;
+		int created = 0;
+		if (!*path) {
+			fprintf(stderr, "invalid fifo path '%s'\n", path);
+			return -1;
+		}
+		if (mkfifo(path, 0660)) {
+			if (errno != EEXIST) {
+				goto fail;
+			}
+		} else {
+			created = 1;
+		}
+		/* opened for writing too, there is no EOF when a writer closes it */
+		if ((l->fd = open(path, O_RDWR | O_NONBLOCK)) < 0) {
+			goto fail;
+		}
+		if (add_client(l->fd)) {
+			close(l->fd);
+			fprintf(stderr, "too many clients, cannot open '%s'\n", path);
+			return -1;
+		}
+		clients[n_clients - 1].fifo = 1;
+		clients[n_clients - 1].reply_fd = -1;
+		l->fd = -1; // not polled
+		l->type = 0;
+		l->osc = 0;
+		l->path = created ? path : NULL;
+		++n_listeners;
+		return 0;
+	} else if (!strncmp(spec, "unix:", 5)) {
+		struct sockaddr_un sun;
+		struct stat st;
+		if (strlen(spec + 5) >= sizeof(sun.sun_path) || !spec[5]) {
+			fprintf(stderr, "invalid socket path '%s'\n", spec + 5);
+			return -1;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, spec + 5);
+		/* replace a stale socket, but no other kind of file */
+		if (!lstat(sun.sun_path, &st)) {
+			if (!S_ISSOCK(st.st_mode)) {
+				fprintf(stderr, "cannot listen on '%s': not a socket\n", spec);
+				return -1;
+			}
+			unlink(sun.sun_path);
+		}
+		if ((l->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+			goto fail;
+		}
+		if (bind(l->fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(l->fd, 16)) {
+			close(l->fd);
+			goto fail;
+		}
+		l->type = SOCK_STREAM;
+		l->osc = 0;
+		l->path = spec + 5;
+	} else if ((stream = !strncmp(spec, "tcp:", 4)) || !strncmp(spec, "udp:", 4) || !strncmp(spec, "osc:", 4)) {
+		struct addrinfo hints, *ai;
+		char host[256] = "localhost";
+		const char *port = strrchr(spec + 4, ':');
+		int rv;
+
+		if (port) {
+			size_t len = port - (spec + 4);
+			if (len >= sizeof(host)) {
+				len = sizeof(host) - 1;
+			}
+			memcpy(host, spec + 4, len);
+			host[len] = '\0';
+			++port;
+			/* "[::1]:port" */
+			if (host[0] == '[' && len > 1 && host[len - 1] == ']') {
+				memmove(host, host + 1, len - 2);
+				host[len - 2] = '\0';
+			}
+		} else {
+			port = spec + 4;
+		}
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = stream ? SOCK_STREAM : SOCK_DGRAM;
+		hints.ai_flags = AI_PASSIVE;
+		if ((rv = getaddrinfo(host, port, &hints, &ai))) {
+			fprintf(stderr, "cannot resolve '%s': %s\n", spec, gai_strerror(rv));
+			return -1;
+		}
+		if ((l->fd = socket(ai->ai_family, ai->ai_socktype, 0)) < 0) {
+			freeaddrinfo(ai);
+			goto fail;
+		}
+		setsockopt(l->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(l->fd, ai->ai_addr, ai->ai_addrlen) || (stream && listen(l->fd, 16))) {
+			freeaddrinfo(ai);
+			close(l->fd);
+			goto fail;
+		}
+		freeaddrinfo(ai);
+		l->type = stream ? SOCK_STREAM : SOCK_DGRAM;
+		l->osc = !strncmp(spec, "osc:", 4);
+		if (l->osc && n_osc + 1 >= MAX_SOURCES) {
+			/* the control thread has the first queues */
+			fprintf(stderr, "too many OSC listeners, max. %d\n", MAX_SOURCES - 1);
+			close(l->fd);
+			return -1;
+		}
+		n_osc += l->osc;
+		l->path = NULL;
+	} else {
+		fprintf(stderr, "invalid listen address '%s'\n", spec);
+		return -1;
+	}
+
+	fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL) | O_NONBLOCK);
+	++n_listeners;
+	return 0;
+
+fail:
+	fprintf(stderr, "cannot listen on '%s': %s\n", spec, strerror(errno));
+	return -1;
+}
+
+static int add_client(int fd) {
+	struct client *c;
+	if (n_clients >= MAX_CLIENTS) {
+		return -1;
+	}
+	c = &clients[n_clients];
+	if (!(c->buf = malloc(line_len))) {
+		return -1;
+	}
+	c->fd = fd;
+	c->fifo = 0;
+	c->len = 0;
+	c->wait.active = 0;
+	c->owner = 0;
+	c->reply_fd = fd == STDIN_FILENO ? -1 : fd;
+	c->dgram = 0;
+	++n_clients;
+	return 0;
+}
+
+static void remove_client(int i) {
+	if (clients[i].fd != STDIN_FILENO && clients[i].fd >= 0) {
+		close(clients[i].fd);
+	}
+	if (clients[i].wait.active) {
+		wait_stop(&clients[i].wait);
+	}
+	if (clients[i].owner && !clients[i].dgram) {
+		owner_release(clients[i].owner);
+	}
+	free(clients[i].buf);
+	clients[i] = clients[--n_clients];
+}
+
+/**
+ * parse complete lines in `buf`, in place.
+ * returns the number of bytes consumed.
+ */
+static size_t control_input(char *buf, size_t len, int eof) {
+	char *pos = buf;
+	char *end = buf + len;
+
+	while (pos < end && client_state != Exit) {
+		char *eol = memchr(pos, '\n', end - pos);
+		if (!eol) {
+			if (!eof) {
+				break;
+			}
+			eol = end; // buf has room for the terminator
+		}
+		*eol = '\0';
+		if (parse_message(pos) == 1) {
+			connect_ports();
+		}
+		pos = eol + 1;
+		if (wait_pending && wait_pending->active) {
+			break; // the rest is parsed after it, see wait_serve()
+		}
+	}
+	return pos > end ? len : (size_t)(pos - buf);
+}
+
+#ifdef HAVE_READLINE
+/**
+ * line editing for an interactive stdin. readline is driven from the
+ * poll loop with its callback interface, batch mode does not use it.
+ */
+static int use_readline = 0;
+static int edit_eof = 0;
+static char *edit_history = NULL; // $HOME/.jack_midi_cmd_history
+
+static void edit_line(char *line) {
+	if (!line) {
+		edit_eof = 1;
+		rl_callback_handler_remove();
+		return;
+	}
+	if (*line) {
+		add_history(line);
+	}
+	reply_to.fd = -1;
+	reply_to.dgram = 0;
+	if (parse_message(line) == 1) {
+		connect_ports();
+	}
+	free(line);
+	if (client_state == Exit || (wait_pending && wait_pending->active)) {
+		rl_callback_handler_remove(); // until the reply, see wait_serve()
+	}
+	fflush(stdout);
+}
+
+/* the word being completed, in the context of the line so far */
+enum { CompleteNone, CompleteCommand, CompleteMacro, CompletePort };
+static int edit_complete_type = CompleteNone;
+static jack_port_t *edit_complete_port = NULL;
+
+static char *edit_complete(const char *text, int state) {
+	static const char **ports = NULL;
+	static size_t i, len;
+	const char *name;
+
+	if (state == 0) {
+		if (ports) {
+			jack_free(ports);
+			ports = NULL;
+		}
+		if (edit_complete_type == CompletePort) {
+			ports = jack_get_ports(j_client, NULL, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput);
+		}
+		i = 0;
+		len = strlen(text);
+	}
+
+	for (;;) {
+		switch (edit_complete_type) {
+			case CompleteCommand:
+				if (i >= sizeof(parser_cmds) / sizeof(parser_cmds[0])) {
+					return NULL;
+				}
+				name = parser_cmds[i++].name;
+				break;
+			case CompleteMacro:
+				if (i >= macro_tables[macros_active].n_macros) {
+					return NULL;
+				}
+				name = macro_tables[macros_active].macro[i++].name;
+				break;
+			case CompletePort:
+				if (!ports || !ports[i]) {
+					return NULL;
+				}
+				name = ports[i++];
+				if (edit_complete_port && jack_port_connected_to(edit_complete_port, name)) {
+					continue;
+				}
+				break;
+			default:
+				return NULL;
+		}
+		if (!strncmp(name, text, len)) {
+			return strdup(name);
+		}
+	}
+}
+
+static char **edit_attempt(const char *text, int start, int end) {
+	const char *p = rl_line_buffer;
+	const char *line_end = rl_line_buffer + start;
+	const char *word = NULL;
+	size_t word_len = 0;
+	uint32_t port = 0;
+	int words = 0;
+
+	/* skip the timestamp and port prefix, then count the words before `start` */
+	while (p < line_end) {
+		const char *w;
+		while (p < line_end && (*p == ' ' || *p == '\t')) {
+			++p;
+		}
+		if (p >= line_end) {
+			break;
+		}
+		for (w = p; p < line_end && *p != ' ' && *p != '\t'; ++p) ;
+		if (words == 0 && (*w == '@' || *w == '+')) {
+			continue;
+		}
+		if (words == 0 && *w == ':') {
+			port = atoi(w + 1) - 1; // ':1' is the first, as with lex_port()
+			continue;
+		}
+		if (words++ == 0) {
+			word = w;
+			word_len = p - w;
+		}
+	}
+
+	edit_complete_type = CompleteNone;
+	edit_complete_port = NULL;
+	if (words == 0) {
+		edit_complete_type = CompleteCommand;
+	} else if (word_len == 4 && !strncmp(word, "fire", 4) && words == 1) {
+		edit_complete_type = CompleteMacro;
+	} else if (word_len == 7 && !strncmp(word, "pattern", 7) && words >= 3) {
+		edit_complete_type = CompleteMacro;
+	} else if (word_len == 7 && !strncmp(word, "connect", 7)) {
+		edit_complete_type = CompletePort;
+		edit_complete_port = port < n_outs ? outs[port].port : NULL;
+	}
+	rl_attempted_completion_over = 1; // no filename completion
+	return rl_completion_matches(text, edit_complete);
+}
+
+static void edit_start(void) {
+	const char *home = getenv("HOME");
+	rl_readline_name = "jack_midi_cmd";
+	rl_attempted_completion_function = edit_attempt;
+	/* port names contain ':' */
+	rl_completer_word_break_characters = (char *)" \t";
+	if (home && (edit_history = malloc(strlen(home) + 24))) {
+		sprintf(edit_history, "%s/.jack_midi_cmd_history", home);
+		read_history(edit_history);
+	}
+	rl_callback_handler_install("> ", edit_line);
+}
+
+static void edit_stop(void) {
+	rl_callback_handler_remove(); // restores the terminal, may be called twice
+	if (edit_history) {
+		stifle_history(1000);
+		write_history(edit_history);
+		free(edit_history);
+		edit_history = NULL;
+	}
+}
+#endif
+
+static void client_reply_to(const struct client *c) {
+	reply_to.fd = c->reply_fd;
+	reply_to.dgram = c->dgram;
+	if (c->dgram) {
+		memcpy(&reply_to.addr, &c->addr, c->addrlen);
+		reply_to.addrlen = c->addrlen;
+	}
+}
+
+/* the messages a client queues are counted for its 'wait',
+ * an owner is claimed once it sends something */
+static void client_owner(uint8_t *owner) {
+	if (!*owner) {
+		*owner = owner_claim();
+	}
+	queue_owner = *owner;
+}
+
+/* parse the complete lines of a client, up to a 'wait' */
+static void client_parse(struct client *c, int eof) {
+	size_t used;
+	client_reply_to(c);
+	client_owner(&c->owner);
+	wait_pending = &c->wait;
+	used = control_input(c->buf, c->len, eof);
+	wait_pending = NULL;
+	queue_owner = 0;
+	if (used == 0 && c->len == line_len - 1) {
+		reply(" -- line too long, ignored\n");
+		used = c->len;
+	}
+	c->len -= used;
+	memmove(c->buf, &c->buf[used], c->len);
+	if (c->fd == STDIN_FILENO && client_state != Exit && !c->wait.active) {
+		reply("> ");
+	}
+	reply_flush();
+}
+
+/* returns -1 when the client disconnected */
+static int client_read(struct client *c) {
+	ssize_t n;
+#ifdef HAVE_READLINE
+	if (use_readline && c->fd == STDIN_FILENO) {
+		client_owner(&c->owner);
+		wait_pending = &c->wait;
+		rl_callback_read_char();
+		wait_pending = NULL;
+		queue_owner = 0;
+		return edit_eof ? -1 : 0;
+	}
+#endif
+	n = read(c->fd, &c->buf[c->len], line_len - 1 - c->len);
+	if (n <= 0) {
+		if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return 0;
+		}
+		return -1;
+	}
+	c->len += n;
+	client_parse(c, 0);
+	return 0;
+}
+
+/**
+ * report the waits that are done, and continue with the input of their
+ * clients. Returns the poll() timeout while any is active: a period,
+ * the input is only read when the process callback ran.
+ */
+static int wait_serve(void) {
+	wait_t *waits[MAX_CLIENTS];
+	int64_t timeout = -1;
+	int i, n = 0;
+
+	if (n_waiting == 0) {
+		if (midi_in.enabled) {
+			input_expire();
+		}
+		return -1;
+	}
+
+	for (i = 0; i < n_clients; ++i) {
+		if (clients[i].wait.active) {
+			waits[n++] = &clients[i].wait;
+		}
+	}
+	wait_input(waits, n);
+
+	for (i = n_clients - 1; i >= 0; --i) {
+		struct client *c = &clients[i];
+		if (!c->wait.active) {
+			continue;
+		}
+		if (!wait_done(&c->wait)) {
+			const int64_t left = ms_until(&c->wait.deadline);
+			if (timeout < 0 || left < timeout) {
+				timeout = left;
+			}
+			continue;
+		}
+		wait_stop(&c->wait);
+		client_reply_to(c);
+		wait_report(&c->wait);
+#ifdef HAVE_READLINE
+		if (use_readline && c->fd == STDIN_FILENO) {
+			reply_flush();
+			rl_callback_handler_install("> ", edit_line);
+			continue;
+		}
+#endif
+		client_parse(c, c->fd < 0);
+		if (c->fd < 0 && !c->wait.active) {
+			remove_client(i); // the rest of a datagram was parsed
+		}
+	}
+	if (timeout >= 0) {
+		const jack_nframes_t rate = jack_get_sample_rate(j_client);
+		const int64_t period = (1000 * (int64_t)jack_get_buffer_size(j_client) + rate - 1) / rate;
+		if (period < timeout) {
+			timeout = period;
+		}
+	}
+	return n_waiting > 0 && timeout < 0 ? 0 : (int)timeout;
+}
+
+static void listener_read(struct listener *l) {
+	if (l->type == SOCK_STREAM) {
+		int fd = accept(l->fd, NULL, NULL);
+		if (fd < 0) {
+			return;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		if (add_client(fd)) {
+			fprintf(stderr, "too many clients, connection refused\n");
+			close(fd);
+		}
+	} else {
+		/* each datagram holds one or more complete lines */
+		ssize_t n;
+		reply_to.fd = l->fd;
+		reply_to.dgram = 1;
+		reply_to.addrlen = sizeof(reply_to.addr);
+		n = recvfrom(l->fd, line_buf, line_len - 1, 0, (struct sockaddr *)&reply_to.addr, &reply_to.addrlen);
+		if (n > 0) {
+			wait_t wait = { 0 };
+			size_t used;
+			client_owner(&l->owner);
+			wait_pending = &wait;
+			used = control_input(line_buf, n, 1);
+			wait_pending = NULL;
+			queue_owner = 0;
+			reply_flush();
+			if (wait.active) {
+				/* keep the rest of the datagram until the reply */
+				struct client *c = &clients[n_clients];
+				if (add_client(-1)) {
+					wait_stop(&wait);
+					reply(" -- too many clients, 'wait' ignored\n");
+					reply_flush();
+					return;
+				}
+				c->wait = wait;
+				c->len = n - used;
+				memcpy(c->buf, &line_buf[used], c->len);
+				c->owner = l->owner;
+				c->reply_fd = l->fd;
+				c->dgram = 1;
+				memcpy(&c->addr, &reply_to.addr, reply_to.addrlen);
+				c->addrlen = reply_to.addrlen;
+			}
+		}
+	}
+}
+
+/**
+ * each OSC listener receives in its own thread, with its own queues,
+ * so a burst of datagrams does not delay the control sockets. The
+ * process callback merges the queues, see queue_drain().
+ */
+static void *osc_thread(void *arg) {
+	const struct listener *l = arg;
+	uint8_t *buf = malloc(line_len);
+
+	input_thread_setup();
+	while (buf && __atomic_load_n(&osc_running, __ATOMIC_ACQUIRE)) {
+		struct pollfd pfd = { l->fd, POLLIN, 0 };
+		ssize_t n;
+		if (poll(&pfd, 1, 100) <= 0) {
+			continue; // re-check osc_running
+		}
+		if ((n = recv(l->fd, buf, line_len, 0)) > 0) {
+			osc_input(buf, n);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static int osc_start(void) {
+	int i;
+	if (n_osc == 0) {
+		return 0;
+	}
+	if (queue_src == -1 && source_claim()) {
+		return -1; // the control thread has the first queues
+	}
+	__atomic_store_n(&osc_running, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < n_listeners; ++i) {
+		if (listeners[i].osc && pthread_create(&listeners[i].thread, NULL, osc_thread, &listeners[i])) {
+			fprintf(stderr, "cannot start OSC thread.\n");
+			listeners[i].osc = 0; // not joined
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void osc_stop(void) {
+	int i;
+	if (!__atomic_load_n(&osc_running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	__atomic_store_n(&osc_running, 0, __ATOMIC_RELEASE);
+	for (i = 0; i < n_listeners; ++i) {
+		if (listeners[i].osc) {
+			pthread_join(listeners[i].thread, NULL);
+		}
+	}
+}
+
+static void close_listeners(void) {
+	int i;
+	for (i = 0; i < n_listeners; ++i) {
+		if (listeners[i].fd >= 0) {
+			close(listeners[i].fd);
+		}
+		if (listeners[i].path) {
+			unlink(listeners[i].path);
+		}
+		if (listeners[i].owner) {
+			owner_release(listeners[i].owner);
+		}
+	}
+	n_listeners = 0;
+	while (n_clients > 0) {
+		remove_client(0);
+	}
+}
+
+/**
+ * interactive mode, wait for input from stdin and all control sockets.
+ * there are no timeouts, signals and jack shutdown wake up the loop.
+ * In daemon mode there is no stdin, the loop runs until a signal.
+ */
+static void control_loop(void) {
+	struct pollfd pfd[2 + MAX_LISTEN + MAX_CLIENTS];
+
+	if (!daemon_mode) {
+		if (add_client(STDIN_FILENO)) {
+			return;
+		}
+#ifdef HAVE_READLINE
+		if ((use_readline = isatty(STDIN_FILENO))) {
+			printf("\n");
+			edit_start();
+		} else
+#endif
+		{
+			printf("\n> "); fflush(stdout);
+		}
+	}
+
+	while (client_state != Exit) {
+		int i, polled, timeout, n = 0;
+
+		timeout = wait_serve();
+		if (n_clients == 0 && n_listeners == 0 && !daemon_mode) {
+			break; // stdin was closed, nothing else to do
+		}
+
+		pfd[n].fd = wakeup_pipe[0];
+		pfd[n++].events = POLLIN;
+		pfd[n].fd = signal_fd; // ignored by poll() if -1
+		pfd[n++].events = POLLIN;
+		for (i = 0; i < n_listeners; ++i) {
+			pfd[n].fd = listeners[i].osc ? -1 : listeners[i].fd;
+			pfd[n++].events = POLLIN;
+		}
+		for (i = 0; i < n_clients; ++i) {
+			pfd[n].fd = clients[i].wait.active ? -1 : clients[i].fd;
+			pfd[n++].events = POLLIN;
+		}
+
+		if (poll(pfd, n, timeout) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		polled = n_clients;
+		if (pfd[0].revents) {
+			char tmp[64];
+			while (read(wakeup_pipe[0], tmp, sizeof(tmp)) > 0) ;
+		}
+#ifdef __linux__
+		if (pfd[1].revents) {
+			signal_read();
+		}
+#endif
+		for (i = 0; i < n_listeners; ++i) {
+			if (pfd[2 + i].revents & POLLIN) {
+				listener_read(&listeners[i]);
+			}
+		}
+		/* new clients are appended, removing one moves the last into its place */
+		for (i = polled - 1; i >= 0; --i) {
+			const struct pollfd *p = &pfd[2 + n_listeners + i];
+			if (!(p->revents & (POLLIN | POLLHUP | POLLERR))) {
+				continue;
+			}
+			if (client_read(&clients[i])) {
+				remove_client(i);
+			}
+		}
+	}
+	reply_to.fd = -1;
+#ifdef HAVE_READLINE
+	if (use_readline) {
+		edit_stop();
+	}
+#endif
+	if (!daemon_mode) {
+		printf("\n");
+	}
+}
+
+#ifndef NO_MAIN // bench/bench.c includes this file
+int main (int argc, char **argv) {
+	int batch_fd = STDIN_FILENO;
+
+	decode_switches (argc, argv);
+	connect_list = &argv[optind];
+	connect_count = argc - optind;
+
+	if (batch && !overflow_set) {
+		overflow_policy = OverflowBlock;
+	}
+	if (batch && daemon_mode) {
+		fprintf(stderr, "--daemon cannot be used with batch mode.\n");
+		return(1);
+	}
+
+	// -=-=-= INITIALIZE =-=-=-
+
+	if (batch_file && (batch_fd = open(batch_file, O_RDONLY)) < 0) {
+		fprintf(stderr, "cannot open '%s': %s\n", batch_file, strerror(errno));
+		return(1);
+	}
+
+	if (alloc_queues(queue_size))
+		goto out;
+
+	line_len = 3 * max_sysex + 256;
+	if (!(line_buf = malloc(line_len)))
+		goto out;
+
+	if (!batch) {
+		int i;
+		for (i = 0; i < n_listen_specs; ++i) {
+			if (listen_on(listen_specs[i]))
+				goto out;
+		}
+		if (pipe(wakeup_pipe))
+			goto out;
+		fcntl(wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+		fcntl(wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+#ifdef __linux__
+		/* before init_jack() starts the first thread */
+		if (signal_init())
+			goto out;
+#endif
+	}
+
+	if (init_jack("midicmd"))
+		goto out;
+	if (jack_portsetup())
+		goto out;
+	if (connect_init())
+		goto out;
+	if (byte_rate > 0) {
+		frames_per_byte = jack_get_sample_rate(j_client) / (double)byte_rate;
+	}
+
+	if (smf_file && smf_load(smf_file, jack_get_sample_rate(j_client)))
+		goto out;
+	if (capture.path && capture_start())
+		goto out;
+
+	if (mlockall (MCL_CURRENT | MCL_FUTURE)) {
+		fprintf(stderr, "Warning: Can not lock memory.\n");
+	}
+	input_thread_setup();
+
+	// -=-=-= RUN =-=-=-
+
+	if (jack_activate (j_client)) {
+		fprintf (stderr, "cannot activate client.\n");
+		goto out;
+	}
+
+	connect_ports();
+
+#ifndef _WIN32
+	if (signal_fd < 0) {
+		signal (SIGHUP, catchsig);
+		signal (SIGINT, catchsig);
+		signal (SIGTERM, catchsig);
+	}
+#endif
+
+	// -=-=-= JACK DOES ALL THE WORK =-=-=-
+
+	if (batch) {
+		batch_start = jack_frame_time(j_client) + jack_get_buffer_size(j_client);
+		queue_owner = owner_claim();
+		batch_read(batch_fd, binary_mode != BinaryOff ? batch_binary : batch_text, binary_mode == BinaryOff);
+		batch_drain();
+		goto out;
+	}
+
+	if (osc_start())
+		goto out;
+	notify_supervisor("READY=1");
+	control_loop();
+	notify_supervisor("STOPPING=1");
+
+	// -=-=-= CLEANUP =-=-=-
+
+out:
+	if (stats.ring_full || stats.port_dropped) {
+		char buf[1024];
+		format_stats(buf, sizeof(buf));
+		fprintf(stderr, "Warning: some events were dropped.\n%s", buf);
+	}
+	if (osc_invalid) {
+		fprintf(stderr, "Warning: ignored %u invalid OSC messages.\n", osc_invalid);
+	}
+	if (binary_in.skipped) {
+		fprintf(stderr, "Warning: skipped %u invalid bytes of input.\n", binary_in.skipped);
+	}
+	connect_stop();
+	osc_stop();
+	cleanup(0);
+	capture_stop(); // after the process callback stopped
+	close_listeners();
+	if (wakeup_pipe[0] >= 0) {
+		close(wakeup_pipe[0]);
+		close(wakeup_pipe[1]);
+	}
+	if (signal_fd >= 0) {
+		close(signal_fd);
+	}
+	free(line_buf);
+	if (batch_fd != STDIN_FILENO) {
+		close(batch_fd);
+	}
+	return(0);
+}
+#endif